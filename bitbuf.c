@@ -2,8 +2,29 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITBUF_X86
+#endif
+
+#ifdef BITBUF_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 unsigned char bitbuf_slopbuf[1];
 
 static void die(const char *fmt, ...) {
@@ -15,6 +36,549 @@ static void die(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+/* Instrumentation hooks
+ * Every thread counts into its own slot so the hot path never takes a lock
+ * or an atomic RMW; slots are linked into a global list and summed on read
+ */
+#ifdef BITBUF_STATS
+struct stat_slot {
+  bitbuf_fn_stats fn[BITBUF_STAT_NFN];
+  unsigned long long reallocs;
+  unsigned long long realloc_bytes;
+  struct stat_slot *next;
+};
+
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stat_key;
+static struct stat_slot *stat_slots;
+/* counts of exited threads and the baseline taken by the last reset */
+static struct stat_slot stat_retired, stat_base;
+static size_t stat_alloc_bits, stat_peak_bits;
+static __thread struct stat_slot *stat_mine;
+
+static unsigned long long stat_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void stat_add(unsigned long long *to, unsigned long long n) {
+  /* Only the owning thread writes a slot; readers load it relaxed */
+  __atomic_store_n(to, *to + n, __ATOMIC_RELAXED);
+}
+
+static void stat_merge(struct stat_slot *to, struct stat_slot *from) {
+  int i;
+  for (i = 0; i < BITBUF_STAT_NFN; ++i) {
+    to->fn[i].calls += __atomic_load_n(&from->fn[i].calls, __ATOMIC_RELAXED);
+    to->fn[i].bytes += __atomic_load_n(&from->fn[i].bytes, __ATOMIC_RELAXED);
+    to->fn[i].cycles +=
+        __atomic_load_n(&from->fn[i].cycles, __ATOMIC_RELAXED);
+  }
+  to->reallocs += __atomic_load_n(&from->reallocs, __ATOMIC_RELAXED);
+  to->realloc_bytes += __atomic_load_n(&from->realloc_bytes, __ATOMIC_RELAXED);
+}
+
+static void stat_retire(void *p) {
+  struct stat_slot *slot = (struct stat_slot *)p, **cur;
+
+  pthread_mutex_lock(&stat_lock);
+  for (cur = &stat_slots; *cur != slot; cur = &(*cur)->next)
+    ;
+  *cur = slot->next;
+  stat_merge(&stat_retired, slot);
+  pthread_mutex_unlock(&stat_lock);
+  free(slot);
+}
+
+static void stat_make_key(void) { pthread_key_create(&stat_key, stat_retire); }
+
+static struct stat_slot *stat_slot(void) {
+  if (stat_mine) return stat_mine;
+
+  pthread_once(&stat_once, stat_make_key);
+  stat_mine = (struct stat_slot *)calloc(1, sizeof(struct stat_slot));
+  if (stat_mine == NULL) die("stats: Could not allocate counters");
+  pthread_setspecific(stat_key, stat_mine);
+
+  pthread_mutex_lock(&stat_lock);
+  stat_mine->next = stat_slots;
+  stat_slots = stat_mine;
+  pthread_mutex_unlock(&stat_lock);
+  return stat_mine;
+}
+
+static void stat_record(int fn, size_t nbytes, unsigned long long cycles) {
+  struct stat_slot *slot = stat_slot();
+  stat_add(&slot->fn[fn].calls, 1);
+  stat_add(&slot->fn[fn].bytes, nbytes);
+  stat_add(&slot->fn[fn].cycles, cycles);
+}
+
+static void stat_realloc(size_t nbytes) {
+  struct stat_slot *slot = stat_slot();
+  stat_add(&slot->reallocs, 1);
+  stat_add(&slot->realloc_bytes, nbytes);
+}
+
+static void stat_alloc(long long bits) {
+  size_t now = __atomic_add_fetch(&stat_alloc_bits, bits, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&stat_peak_bits, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&stat_peak_bits, &peak,
+                                                    now, 1, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+    ;
+}
+
+#define STAT_BEGIN() unsigned long long _stat_t0 = stat_clock()
+#define STAT_END(fn, nbytes) stat_record(fn, nbytes, stat_clock() - _stat_t0)
+#define STAT_REALLOC(nbytes) stat_realloc(nbytes)
+#define STAT_ALLOC(bits) stat_alloc(bits)
+#else
+#define STAT_BEGIN()
+#define STAT_END(fn, nbytes)
+#define STAT_REALLOC(nbytes)
+#define STAT_ALLOC(bits)
+#endif
+
+/* `min()` from bitbuf.h truncates to int, bit counts may not fit */
+static inline size_t szmin(size_t a, size_t b) { return a < b ? a : b; }
+
+/* Reverse the bits of every byte in a word */
+static inline uint64_t rev_bytes(uint64_t w) {
+  w = (w >> 1 & 0x5555555555555555ULL) | (w & 0x5555555555555555ULL) << 1;
+  w = (w >> 2 & 0x3333333333333333ULL) | (w & 0x3333333333333333ULL) << 2;
+  return (w >> 4 & 0x0f0f0f0f0f0f0f0fULL) | (w & 0x0f0f0f0f0f0f0f0fULL) << 4;
+}
+
+/* Bit order
+ * The code works on bytes whose first bit is the most significant one.
+ * Under BITBUF_LSB_FIRST the first bit in memory is the least significant
+ * one instead; ORD() turns a byte (or a byte mask) from one view into the
+ * other, both ways, and is free otherwise. BIT_MASK() picks stream bit `n`
+ * out of its byte, and TO_START() / TO_END() move the bits of a byte `k`
+ * places toward either end of the stream. Bitwise operations, popcounts and
+ * memmove()s need no conversion
+ */
+#ifdef BITBUF_LSB_FIRST
+#define ORD(c) ((unsigned char)rev_bytes((unsigned char)(c)))
+#define BIT_MASK(n) (1 << (n) % 8)
+#define TO_START(c, k) ((c) >> (k))
+#define TO_END(c, k) ((c) << (k))
+#else
+#define ORD(c) ((unsigned char)(c))
+#define BIT_MASK(n) (0x80 >> (n) % 8)
+#define TO_START(c, k) ((c) << (k))
+#define TO_END(c, k) ((c) >> (k))
+#endif
+
+/* Load / store 8 bytes as one word whose most significant bit is the first
+ * bit of the stream
+ */
+static inline uint64_t ldword(const unsigned char *p) {
+  uint64_t w;
+  memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+#ifdef BITBUF_LSB_FIRST
+  w = rev_bytes(w);
+#endif
+  return w;
+}
+
+static inline void stword(unsigned char *p, uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+#ifdef BITBUF_LSB_FIRST
+  w = rev_bytes(w);
+#endif
+  memcpy(p, &w, 8);
+}
+
+/* Read `k` <= 64 bits starting at bit `pos` into the low bits of a word
+ * Only the bytes holding those bits are touched
+ */
+static uint64_t getbits(const unsigned char *p, size_t pos, size_t k) {
+  if (!k) return 0;
+
+  size_t first = pos / 8;
+  size_t last = (pos + k - 1) / 8;
+  size_t trail = 7 - (pos + k - 1) % 8;
+  uint64_t v = ORD(p[first]) & (0xff >> pos % 8);
+  if (first == last) return v >> trail;
+
+  size_t i;
+  for (i = first + 1; i < last; ++i) v = v << 8 | ORD(p[i]);
+  return v << (8 - trail) | ORD(p[last]) >> trail;
+}
+
+/* Overwrite `k` <= 64 bits starting at bit `pos` with the low bits of `v`,
+ * leaving the neighbouring bits alone
+ */
+static void putbits(unsigned char *p, size_t pos, size_t k, uint64_t v) {
+  if (!k) return;
+
+  size_t first = pos / 8;
+  size_t last = (pos + k - 1) / 8;
+  size_t trail = 7 - (pos + k - 1) % 8;
+  unsigned char head = 0xff >> pos % 8;
+  unsigned char tail = 0xff << trail;
+  if (first == last) {
+    unsigned char m = ORD(head & tail);
+    p[first] = (p[first] & ~m) | (ORD(v << trail) & m);
+    return;
+  }
+
+  p[last] = (p[last] & ~ORD(tail)) | ORD(v << trail);
+  v >>= 8 - trail;
+  size_t i;
+  for (i = last - 1; i > first; --i, v >>= 8) p[i] = ORD(v);
+  p[first] = (p[first] & ~ORD(head)) | ORD(v & head);
+}
+
+/* `k` <= 64 bits at `pos` moved to the top of a word, with whole-word loads
+ * whenever the bytes exist within the first `limit` bits
+ */
+static inline uint64_t load_bits(const unsigned char *p, size_t pos, size_t k,
+                                 size_t limit) {
+  uint64_t w;
+  size_t sh = pos % 8;
+  if (pos / 8 + 9 <= BYTE_LEN(limit))
+    w = ldword(p + pos / 8) << sh | (uint64_t)ORD(p[pos / 8 + 8]) >> (8 - sh);
+  else if (sh == 0 && pos + 64 <= limit)
+    w = ldword(p + pos / 8);
+  else
+    return k ? getbits(p, pos, k) << (64 - k) : 0;
+  return k == 64 ? w : w & ~(~0ULL >> k);
+}
+
+/* Bit-granular memmove() */
+static void copy_bits(unsigned char *d, size_t dpos, const unsigned char *s,
+                      size_t spos, size_t n) {
+  if (!n) return;
+
+  size_t k, sph;
+  uint64_t w;
+
+  /* Same phase: only the edges need masking and memmove() covers the
+   * middle with whatever vector code libc has. Edges are read up front in
+   * case the middle overwrites them
+   */
+  if (dpos % 8 == spos % 8) {
+    size_t head = szmin((8 - dpos % 8) % 8, n);
+    size_t mid = (n - head) / 8;
+    size_t tail = (n - head) % 8;
+    uint64_t hv = getbits(s, spos, head);
+    uint64_t tv = getbits(s, spos + head + mid * 8, tail);
+
+    memmove(d + (dpos + head) / 8, s + (spos + head) / 8, mid);
+    putbits(d, dpos, head, hv);
+    putbits(d, dpos + head + mid * 8, tail, tv);
+    return;
+  }
+
+  /* Different phase: shift-merge whole words into a byte-aligned
+   * destination, front to back unless the destination overlaps the source
+   * from above
+   */
+  if ((uintptr_t)d * 8 + dpos <= (uintptr_t)s * 8 + spos) {
+    k = szmin((8 - dpos % 8) % 8, n);
+    putbits(d, dpos, k, getbits(s, spos, k));
+    dpos += k, spos += k, n -= k;
+
+    sph = spos % 8;
+    for (; n > 64; dpos += 64, spos += 64, n -= 64) {
+      w = ldword(s + spos / 8) << sph | ORD(s[spos / 8 + 8]) >> (8 - sph);
+      stword(d + dpos / 8, w);
+    }
+    putbits(d, dpos, n, getbits(s, spos, n));
+  } else {
+    k = szmin((dpos + n) % 8, n);
+    n -= k;
+    putbits(d, dpos + n, k, getbits(s, spos + n, k));
+
+    for (; n >= 72; n -= 64) {
+      size_t sp = spos + n - 64;
+      sph = sp % 8;
+      w = ldword(s + sp / 8) << sph | ORD(s[sp / 8 + 8]) >> (8 - sph);
+      stword(d + (dpos + n - 64) / 8, w);
+    }
+    while (n) {
+      k = szmin(n, 64);
+      n -= k;
+      putbits(d, dpos + n, k, getbits(s, spos + n, k));
+    }
+  }
+}
+
+/* Zero the unused bits of the last byte */
+static void clear_tail(bitbuf *bb) {
+  if (bb->len % 8) bb->buf[bb->len / 8] &= ORD(0xff << (8 - bb->len % 8));
+}
+
+/* Sequential writer that collects bits in a word and stores whole words
+ * The destination must start byte-aligned and be large enough for
+ * everything put into it
+ */
+typedef struct {
+  unsigned char *p;
+  uint64_t acc;
+  size_t fill;
+} bitwriter;
+
+static inline void bw_init(bitwriter *w, unsigned char *p) {
+  w->p = p;
+  w->acc = 0;
+  w->fill = 0;
+}
+
+/* Append the low `k` <= 64 bits of `v` */
+static inline void bw_put(bitwriter *w, uint64_t v, size_t k) {
+  if (!k) return;
+  if (k < 64) v &= (1ULL << k) - 1;
+
+  size_t room = 64 - w->fill;
+  if (k < room) {
+    w->acc |= v << (room - k);
+    w->fill += k;
+    return;
+  }
+
+  stword(w->p, w->acc | v >> (k - room));
+  w->p += 8;
+  w->fill = k - room;
+  w->acc = w->fill ? v << (64 - w->fill) : 0;
+}
+
+static inline void bw_flush(bitwriter *w) {
+  size_t i;
+  for (i = 0; i < BYTE_LEN(w->fill); ++i)
+    w->p[i] = ORD(w->acc >> (56 - 8 * i));
+}
+
+/* Parallel bit extract / deposit
+ * BMI2 `pext`/`pdep` when the CPU has them, byte tables otherwise. The
+ * implementation is picked once at runtime. Define BITBUF_NO_BMI2 on CPUs
+ * where they are microcoded (AMD before Zen 3)
+ */
+static unsigned char pext8[256][256];
+static unsigned char pdep8[256][256];
+
+static uint64_t pext_soft(uint64_t x, uint64_t m) {
+  uint64_t r = 0;
+  int i;
+  for (i = 56; i >= 0; i -= 8) {
+    unsigned char mb = m >> i;
+    r = r << __builtin_popcount(mb) | pext8[mb][(unsigned char)(x >> i)];
+  }
+  return r;
+}
+
+static uint64_t pdep_soft(uint64_t x, uint64_t m) {
+  uint64_t r = 0;
+  int i;
+  for (i = 0; i < 64; i += 8) {
+    unsigned char mb = m >> i;
+    r |= (uint64_t)pdep8[mb][(unsigned char)x] << i;
+    x >>= __builtin_popcount(mb);
+  }
+  return r;
+}
+
+#if defined(BITBUF_X86) && !defined(BITBUF_NO_BMI2)
+__attribute__((target("bmi2"))) static uint64_t pext_bmi2(uint64_t x,
+                                                          uint64_t m) {
+  return _pext_u64(x, m);
+}
+
+__attribute__((target("bmi2"))) static uint64_t pdep_bmi2(uint64_t x,
+                                                          uint64_t m) {
+  return _pdep_u64(x, m);
+}
+#endif
+
+static uint64_t (*pext)(uint64_t, uint64_t);
+static uint64_t (*pdep)(uint64_t, uint64_t);
+static pthread_once_t pext_once = PTHREAD_ONCE_INIT;
+
+static void pext_init(void) {
+#if defined(BITBUF_X86) && !defined(BITBUF_NO_BMI2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("bmi2")) {
+    pext = pext_bmi2;
+    pdep = pdep_bmi2;
+    return;
+  }
+#endif
+  int m, x, b, k;
+  for (m = 0; m < 256; ++m) {
+    for (x = 0; x < 256; ++x) {
+      for (b = 0, k = 0; b < 8; ++b) {
+        if (!(m >> b & 1)) continue;
+        pext8[m][x] |= (x >> b & 1) << k;
+        pdep8[m][x] |= (x >> k & 1) << b;
+        ++k;
+      }
+    }
+  }
+  pext = pext_soft;
+  pdep = pdep_soft;
+}
+
+/* Thread pool
+ * A job is a range of items cut into fixed chunks. The caller and every
+ * worker claim chunks off a shared atomic counter until none are left, so
+ * a slow thread simply ends up taking fewer of them. Only one job runs at a
+ * time; a second caller (or a nested one) finds the pool busy and runs its
+ * chunks serially instead of waiting
+ */
+typedef void (*par_fn)(size_t lo, size_t hi, void *ctx);
+
+struct par_job {
+  par_fn fn;
+  void *ctx;
+  size_t n;
+  size_t chunk;
+  size_t next;
+};
+
+static pthread_mutex_t par_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t *par_workers;
+static size_t par_nthreads = 1;
+static struct par_job *par_cur;
+static unsigned long par_gen;
+static size_t par_active;
+static int par_quit;
+
+static void par_work(struct par_job *job) {
+  size_t lo;
+  while ((lo = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED)) <
+         job->n)
+    job->fn(lo, szmin(lo + job->chunk, job->n), job->ctx);
+}
+
+static void *par_worker(void *arg) {
+  unsigned long seen = 0;
+  struct par_job *job;
+  (void)arg;
+
+  pthread_mutex_lock(&par_lock);
+  for (;;) {
+    while (!par_quit && par_gen == seen)
+      pthread_cond_wait(&par_wake, &par_lock);
+    if (par_quit) break;
+    seen = par_gen;
+    if ((job = par_cur) == NULL) continue;
+
+    par_active++;
+    pthread_mutex_unlock(&par_lock);
+    par_work(job);
+    pthread_mutex_lock(&par_lock);
+    if (!--par_active) pthread_cond_signal(&par_idle);
+  }
+  pthread_mutex_unlock(&par_lock);
+  return NULL;
+}
+
+/* Chunk size for `n` items worth `bytes` bytes, a multiple of `align`
+ * items. A single chunk means the job is not worth splitting
+ */
+static size_t par_chunk(size_t n, size_t align, size_t bytes) {
+  size_t t = __atomic_load_n(&par_nthreads, __ATOMIC_RELAXED);
+  if (t < 2 || bytes < BITBUF_PAR_MIN || !n) return n ? n : 1;
+
+  /* a few chunks per thread to even out the load */
+  size_t chunk = (n + t * 4 - 1) / (t * 4);
+  return (chunk + align - 1) / align * align;
+}
+
+static void par_run(size_t n, size_t chunk, par_fn fn, void *ctx) {
+  struct par_job job = {fn, ctx, n, chunk, 0};
+
+  if (chunk >= n || pthread_mutex_trylock(&par_busy)) {
+    par_work(&job);
+    return;
+  }
+  if (par_workers == NULL) {
+    pthread_mutex_unlock(&par_busy);
+    par_work(&job);
+    return;
+  }
+
+  pthread_mutex_lock(&par_lock);
+  par_cur = &job;
+  par_gen++;
+  pthread_cond_broadcast(&par_wake);
+  pthread_mutex_unlock(&par_lock);
+
+  par_work(&job);
+
+  /* Every chunk is claimed; wait for those still being worked on */
+  pthread_mutex_lock(&par_lock);
+  while (par_active) pthread_cond_wait(&par_idle, &par_lock);
+  par_cur = NULL;
+  pthread_mutex_unlock(&par_lock);
+  pthread_mutex_unlock(&par_busy);
+}
+
+static void par_stop(void) {
+  size_t i;
+  if (par_workers == NULL) return;
+
+  pthread_mutex_lock(&par_lock);
+  par_quit = 1;
+  pthread_cond_broadcast(&par_wake);
+  pthread_mutex_unlock(&par_lock);
+  for (i = 0; i + 1 < par_nthreads; ++i) pthread_join(par_workers[i], NULL);
+
+  free(par_workers);
+  par_workers = NULL;
+  par_quit = 0;
+  __atomic_store_n(&par_nthreads, 1, __ATOMIC_RELAXED);
+}
+
+static void par_exit(void) {
+  pthread_mutex_lock(&par_busy);
+  par_stop();
+  pthread_mutex_unlock(&par_busy);
+}
+
+static void par_atexit(void) { atexit(par_exit); }
+
+void bitbuf_set_threads(size_t n) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  size_t i;
+  int err;
+
+  pthread_once(&once, par_atexit);
+  pthread_mutex_lock(&par_busy);
+  par_stop();
+
+  if (n > 1) {
+    par_workers = (pthread_t *)malloc((n - 1) * sizeof(pthread_t));
+    if (par_workers == NULL) die("set_threads: Could not allocate workers");
+    for (i = 0; i + 1 < n; ++i)
+      if ((err = pthread_create(&par_workers[i], NULL, par_worker, NULL)))
+        die("set_threads: Could not start worker: %s", strerror(err));
+    __atomic_store_n(&par_nthreads, n, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&par_busy);
+}
+
+size_t bitbuf_get_threads(void) {
+  return __atomic_load_n(&par_nthreads, __ATOMIC_RELAXED);
+}
+
 void bitbuf_init(bitbuf *bb, size_t s) {
   bb->buf = bitbuf_slopbuf;
   bb->len = bb->alloc = 0;
@@ -23,10 +587,17 @@ void bitbuf_init(bitbuf *bb, size_t s) {
 }
 
 void bitbuf_init_zero(bitbuf *bb, size_t s) {
+  /* An empty buffer owns nothing, bitbuf_grow() would lose a calloc(0) */
+  if (!s) {
+    bitbuf_init(bb, 0);
+    return;
+  }
+
   size_t n = BYTE_LEN(s);
   bb->buf = (unsigned char *)calloc(n, sizeof(unsigned char));
   bb->len = s;
   bb->alloc = n * 8;
+  STAT_ALLOC(bb->alloc);
 }
 
 void bitbuf_init_file(bitbuf *bb, const char *fname) {
@@ -60,8 +631,8 @@ void bitbuf_init_str(bitbuf *bb, const char *str) {
 }
 
 void bitbuf_init_sub(bitbuf *dest, const bitbuf *src, size_t start, size_t n) {
-  bitbuf_init(dest, src->len);
-  bitbuf_slice(dest, src, start, n);
+  bitbuf_init(dest, n);
+  bitbuf_copy_bits(dest, 0, src, start, n);
 }
 
 void bitbuf_reset(bitbuf *bb) {
@@ -71,6 +642,7 @@ void bitbuf_reset(bitbuf *bb) {
 
 void bitbuf_release(bitbuf *bb) {
   if (bb->alloc) {
+    STAT_ALLOC(-(long long)bb->alloc);
     free(bb->buf);
     bitbuf_init(bb, 0);
   }
@@ -82,6 +654,7 @@ void bitbuf_attach(bitbuf *bb, const void *data, size_t alloc, size_t len) {
   bb->buf = (unsigned char *)data;
   bb->len = len * 8;
   bb->alloc = alloc * 8;
+  STAT_ALLOC(bb->alloc);
 }
 
 unsigned char *bitbuf_detach(bitbuf *bb, size_t *len) {
@@ -89,6 +662,7 @@ unsigned char *bitbuf_detach(bitbuf *bb, size_t *len) {
   res = bb->buf;
 
   if (len) *len = bb->len;
+  STAT_ALLOC(-(long long)bb->alloc);
 
   bb->buf = NULL;
   bb->len = bb->alloc = 0;
@@ -100,19 +674,36 @@ void bitbuf_copy(bitbuf *dest, const bitbuf *src) {
   bitbuf_addbuf(dest, src);
 }
 
+void bitbuf_copy_bits(bitbuf *dest, size_t dpos, const bitbuf *src,
+                      size_t spos, size_t n) {
+  if (spos + n > src->len || dpos > dest->len)
+    die("copy_bits: Out of bounds");
+  if (dpos + n > dest->alloc) bitbuf_grow(dest, dpos + n - dest->alloc);
+
+  copy_bits(dest->buf, dpos, src->buf, spos, n);
+  if (dpos + n > dest->len) {
+    dest->len = dpos + n;
+    clear_tail(dest);
+  }
+}
+
 void bitbuf_grow(bitbuf *bb, size_t extra) {
+  STAT_BEGIN();
   size_t newlen = BYTE_LEN(bb->alloc + extra);
   size_t oldlen = BYTE_LEN(bb->alloc);
 
   int new_buf = !(bb->alloc);
   if (new_buf) bb->buf = NULL;
 
+  STAT_REALLOC(newlen);
   if ((bb->buf = (unsigned char *)realloc(bb->buf, newlen)) == NULL) {
     die("grow: Could not allocate more buffer space");
   } else {
     memset(bb->buf + oldlen, 0, newlen - oldlen);
+    STAT_ALLOC(newlen * 8 - (long long)bb->alloc);
     bb->alloc = newlen * 8;
   }
+  STAT_END(BITBUF_STAT_GROW, newlen - oldlen);
 }
 
 void bitbuf_setlen(bitbuf *bb, size_t len) {
@@ -127,29 +718,83 @@ static size_t popcnt(const unsigned char c) {
   return res;
 }
 
-size_t bitbuf_weight(const bitbuf *bb) {
-  size_t i, cnt;
-  cnt = 0;
-  for (i = 0; i < BYTE_LEN(bb->len); ++i) cnt += popcnt(bb->buf[i]);
+struct weight_ctx {
+  const unsigned char *p;
+  size_t cnt;
+};
 
+static size_t weight_bytes(const unsigned char *p, size_t n) {
+  size_t i, cnt = 0;
+  for (i = 0; i + 8 <= n; i += 8) cnt += __builtin_popcountll(ldword(p + i));
+  for (; i < n; ++i) cnt += popcnt(p[i]);
   return cnt;
 }
 
+static void weight_range(size_t lo, size_t hi, void *ctx) {
+  struct weight_ctx *c = (struct weight_ctx *)ctx;
+  __atomic_fetch_add(&c->cnt, weight_bytes(c->p + lo, hi - lo),
+                     __ATOMIC_RELAXED);
+}
+
+size_t bitbuf_weight(const bitbuf *bb) {
+  STAT_BEGIN();
+  size_t n = BYTE_LEN(bb->len);
+  struct weight_ctx c = {bb->buf, 0};
+  par_run(n, par_chunk(n, 64, n), weight_range, &c);
+
+  STAT_END(BITBUF_STAT_WEIGHT, n);
+  return c.cnt;
+}
+
+/* Patterns that fit in a word with a byte of slack are matched against all
+ * 8 bit offsets of every source byte at once: one 64-bit load per byte, and
+ * a shifted XOR plus popcount per offset, garbling included
+ */
+#define FIND_SHORT 56
+
+static int find_short(const bitbuf *src, const bitbuf *pat, size_t garble,
+                      size_t offset) {
+  size_t m = pat->len, last = src->len - m, j, s, pos;
+  uint64_t top = ~(~0ULL >> m);
+  uint64_t pw = load_bits(pat->buf, 0, m, m);
+  uint64_t w;
+
+  for (j = offset / 8; j * 8 <= last; ++j) {
+    w = load_bits(src->buf, j * 8, szmin(64, src->len - j * 8), src->len);
+    for (s = offset > j * 8 ? offset - j * 8 : 0; s < 8; ++s) {
+      pos = j * 8 + s;
+      if (pos > last) break;
+      if ((size_t)__builtin_popcountll(((w << s) & top) ^ pw) <= garble)
+        return pos;
+    }
+  }
+  return -1;
+}
+
 int bitbuf_find(const bitbuf *src, const bitbuf *pat, size_t garble,
                 size_t offset) {
-  if (pat->len > src->len - offset || pat->len <= 8 || garble >= pat->len)
+  if (offset > src->len || pat->len > src->len - offset || !pat->len ||
+      garble >= pat->len)
     return -1;
 
+  STAT_BEGIN();
   int hit = -1;
   size_t i, cur, width, patlen, weight;
   weight = 0;
+
+  if (pat->len <= FIND_SHORT) {
+    hit = find_short(src, pat, garble, offset);
+    cur = hit < 0 ? src->len - pat->len + 1 : (size_t)hit;
+    STAT_END(BITBUF_STAT_FIND, (cur - offset + pat->len) / 8);
+    return hit;
+  }
   patlen = BYTE_LEN(pat->len);
   width = patlen + 1;
 
   unsigned char temp[width];
   memset(temp, 0, width);
-  bitbuf win = BITBUF_INIT;
-  bitbuf_attach(&win, temp, width, width);
+  /* A view of the stack, not attached: it was never allocated */
+  bitbuf win = {width * 8, 0, temp};
 
   for (cur = offset; cur <= src->len - pat->len; ++cur) {
     weight = 0;
@@ -167,12 +812,185 @@ int bitbuf_find(const bitbuf *src, const bitbuf *pat, size_t garble,
     }
   }
 
+  STAT_END(BITBUF_STAT_FIND, (cur - offset + pat->len) / 8);
+  return hit;
+}
+
+/* Compiled patterns
+ * The pattern is laid out at each of the 8 bit offsets within a byte, with a
+ * mask of the bits it covers. Byte `anchor` is whole at every offset, so a
+ * source byte there picks the offsets worth verifying, and a Horspool table
+ * says how many bytes later the next window could possibly line up
+ */
+struct _bitbuf_pattern {
+  bitbuf pat;
+  size_t anchor;
+  size_t nbytes[8];
+  unsigned char *bytes[8];
+  unsigned char *mask[8];
+  unsigned char cand[256]; /* offsets whose anchor byte is the index */
+  size_t skip[256];
+};
+
+bitbuf_pattern *bitbuf_pattern_compile(const bitbuf *pat) {
+  bitbuf_pattern *cp = (bitbuf_pattern *)calloc(1, sizeof(*cp));
+  if (cp == NULL) die("pattern_compile: Could not allocate pattern");
+  bitbuf_init(&cp->pat, 0);
+  bitbuf_copy(&cp->pat, pat);
+  if (pat->len < 16) return cp;
+
+  size_t m = pat->len, s, t, c, total = 0;
+  for (s = 0; s < 8; ++s) total += cp->nbytes[s] = BYTE_LEN(s + m);
+  unsigned char *mem = (unsigned char *)calloc(2, total);
+  if (mem == NULL) die("pattern_compile: Could not allocate pattern");
+
+  bitbuf ones = BITBUF_INIT;
+  bitbuf_init_zero(&ones, m);
+  bitbuf_set_range(&ones, 0, m);
+  for (s = 0; s < 8; ++s) {
+    cp->bytes[s] = mem;
+    cp->mask[s] = mem + cp->nbytes[s];
+    mem += 2 * cp->nbytes[s];
+    copy_bits(cp->bytes[s], s, pat->buf, 0, m);
+    copy_bits(cp->mask[s], s, ones.buf, 0, m);
+  }
+  bitbuf_release(&ones);
+
+  /* Every byte before the anchor that could line up with a source byte
+   * bounds the skip; later bytes overwrite earlier ones with shorter skips
+   */
+  size_t a = cp->anchor = m / 8 - 1;
+  for (c = 0; c < 256; ++c) cp->skip[c] = a + 1;
+  for (t = 0; t < a; ++t) {
+    for (s = 0; s < 8; ++s) {
+      unsigned char mk = cp->mask[s][t], b = cp->bytes[s][t];
+      if (mk == 0xff) {
+        cp->skip[b] = a - t;
+        continue;
+      }
+      for (c = 0; c < 256; ++c)
+        if ((c & mk) == b) cp->skip[c] = a - t;
+    }
+  }
+  for (s = 0; s < 8; ++s) cp->cand[cp->bytes[s][a]] |= 1 << s;
+  return cp;
+}
+
+void bitbuf_pattern_free(bitbuf_pattern *cp) {
+  bitbuf_release(&cp->pat);
+  free(cp->bytes[0]);
+  free(cp);
+}
+
+/* Does the pattern laid out at offset `s` match the bytes at `p`? */
+static int pattern_at(const bitbuf_pattern *cp, const unsigned char *p,
+                      size_t s) {
+  const unsigned char *b = cp->bytes[s], *mk = cp->mask[s];
+  size_t t, n = cp->nbytes[s];
+  for (t = 0; t + 8 <= n; t += 8)
+    if ((ldword(p + t) & ldword(mk + t)) != ldword(b + t)) return 0;
+  for (; t < n; ++t)
+    if ((p[t] & mk[t]) != b[t]) return 0;
+  return 1;
+}
+
+int bitbuf_find_compiled(const bitbuf *src, const bitbuf_pattern *cp,
+                         size_t offset) {
+  size_t m = cp->pat.len;
+  if (m < 16) return bitbuf_find(src, &cp->pat, 0, offset);
+  if (offset > src->len || m > src->len - offset) return -1;
+
+  STAT_BEGIN();
+  int hit = -1;
+  size_t j, s, pos, last = src->len - m;
+  unsigned char c, cand;
+
+  for (j = offset / 8; j * 8 <= last; j += cp->skip[c]) {
+    c = src->buf[j + cp->anchor];
+    for (cand = cp->cand[c]; cand; cand &= cand - 1) {
+      s = __builtin_ctz(cand);
+      pos = j * 8 + s;
+      if (pos < offset || pos > last) continue;
+      if (pattern_at(cp, src->buf + j, s)) {
+        hit = pos;
+        goto done;
+      }
+    }
+  }
+
+done:
+  STAT_END(BITBUF_STAT_FIND, BYTE_LEN(src->len) - offset / 8);
+  return hit;
+}
+
+/* Approximate search with insertions and deletions
+ * Myers' bit-vector algorithm, in the blocked form from Hyyrö: the column of
+ * the edit distance matrix for each source bit is kept as vertical +1 / -1
+ * deltas (Pv / Mv), 64 pattern rows per word, and every block passes the
+ * horizontal delta of its last row down to the next
+ */
+static int myers_block(uint64_t *pv, uint64_t *mv, uint64_t eq, int hin,
+                       uint64_t last) {
+  uint64_t neg = hin < 0;
+  uint64_t xv = eq | *mv;
+  eq |= neg;
+  uint64_t xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+  uint64_t ph = *mv | ~(xh | *pv);
+  uint64_t mh = *pv & xh;
+  int hout = (ph & last) ? 1 : (mh & last) ? -1 : 0;
+
+  ph = ph << 1 | (hin > 0);
+  mh = mh << 1 | neg;
+  *pv = mh | ~(xv | ph);
+  *mv = ph & xv;
+  return hout;
+}
+
+int bitbuf_find_edit(const bitbuf *src, const bitbuf *pat, size_t max_edits,
+                     size_t offset, size_t *dist) {
+  size_t m = pat->len;
+  if (!m || max_edits >= m || offset > src->len) return -1;
+
+  STAT_BEGIN();
+  size_t nb = (m + 63) / 64, b, i, j, score = m, best = 0;
+  uint64_t *mem = (uint64_t *)calloc(4 * nb, sizeof(uint64_t));
+  if (mem == NULL) die("find_edit: Could not allocate %zu blocks", nb);
+  uint64_t *peq[2] = {mem, mem + nb}, *pv = mem + 2 * nb, *mv = mem + 3 * nb;
+  uint64_t w = 0, last = 1ULL << (m - 1) % 64;
+  int hit = -1, h;
+
+  for (i = 0; i < m; ++i)
+    peq[bitbuf_getbit(pat, i)][i / 64] |= 1ULL << i % 64;
+  for (b = 0; b < nb; ++b) pv[b] = ~0ULL;
+
+  for (j = offset; j < src->len; ++j, w <<= 1) {
+    if ((j - offset) % 64 == 0)
+      w = load_bits(src->buf, j, szmin(64, src->len - j), src->len);
+
+    /* The top row is all zeros: a match may start anywhere */
+    for (b = 0, h = 0; b < nb; ++b)
+      h = myers_block(&pv[b], &mv[b], peq[w >> 63][b], h,
+                      b + 1 < nb ? 1ULL << 63 : last);
+    score += h;
+
+    /* Take the first match, extended as long as its distance drops */
+    if (hit >= 0 && score >= best) break;
+    if (score <= max_edits && (hit < 0 || score < best)) {
+      hit = j + 1;
+      best = score;
+    }
+  }
+
+  free(mem);
+  if (dist && hit >= 0) *dist = best;
+  STAT_END(BITBUF_STAT_FIND, (j - offset) / 8);
   return hit;
 }
 
 int bitbuf_replace(bitbuf *src, const bitbuf *old, const bitbuf *fresh,
                    size_t garble, size_t start, size_t end) {
   if (old->len == 0) die("replace: Cannot replace an empty buffer");
+  STAT_BEGIN();
 
   int hit, cur, cnt;
   cur = cnt = 0;
@@ -195,45 +1013,79 @@ int bitbuf_replace(bitbuf *src, const bitbuf *old, const bitbuf *fresh,
   bitbuf_release(&win);
   bitbuf_release(src);
   bitbuf_swap(src, &res);
+  STAT_END(BITBUF_STAT_REPLACE, BYTE_LEN(src->len));
   return cnt;
 }
 
+/* Offset of the first differing bit of the two ranges, `n` if none */
+static size_t first_diff(const bitbuf *a, size_t astart, const bitbuf *b,
+                         size_t bstart, size_t n) {
+  size_t i, k;
+  uint64_t x;
+
+  for (i = 0; i < n; i += 64) {
+    k = szmin(64, n - i);
+    x = load_bits(a->buf, astart + i, k, a->len) ^
+        load_bits(b->buf, bstart + i, k, b->len);
+    if (x) return i + __builtin_clzll(x);
+  }
+  return n;
+}
+
+size_t bitbuf_first_diff(const bitbuf *a, const bitbuf *b) {
+  return first_diff(a, 0, b, 0, szmin(a->len, b->len));
+}
+
+size_t bitbuf_first_diff_range(const bitbuf *a, size_t astart,
+                               const bitbuf *b, size_t bstart, size_t n) {
+  if (astart + n > a->len || bstart + n > b->len)
+    die("first_diff: Out of bounds");
+  return first_diff(a, astart, b, bstart, n);
+}
+
+int bitbuf_cmp_range(const bitbuf *a, size_t astart, const bitbuf *b,
+                     size_t bstart, size_t n) {
+  size_t d = bitbuf_first_diff_range(a, astart, b, bstart, n);
+  if (d == n) return 0;
+  return bitbuf_getbit(a, astart + d) ? 1 : -1;
+}
+
 int bitbuf_cmp(const bitbuf *a, const bitbuf *b) {
   if (a->len != b->len) die("cmp: Buffers should be the same length");
-  return memcmp(a->buf, b->buf, BYTE_LEN(a->len));
+  return bitbuf_cmp_range(a, 0, b, 0, a->len);
+}
+
+int bitbuf_cmp_lex(const bitbuf *a, const bitbuf *b) {
+  size_t n = szmin(a->len, b->len);
+  size_t d = first_diff(a, 0, b, 0, n);
+  if (d < n) return bitbuf_getbit(a, d) ? 1 : -1;
+  return (a->len > b->len) - (a->len < b->len);
 }
 
 void bitbuf_slice(bitbuf *dest, const bitbuf *src, size_t start, size_t n) {
   if (start + n > src->len) die("slice: Out of bounds");
+  STAT_BEGIN();
 
-  size_t width = BYTE_LEN(n + start % 8) * 8;
+  size_t width = BYTE_LEN(n) * 8;
   if (width > dest->alloc) bitbuf_grow(dest, width - dest->alloc);
 
-  memcpy(dest->buf, &src->buf[start / 8], width / 8);
-  dest->len = width;
-
-  /* clean trash at left */
-  bitbuf_lsh(dest, start % 8);
-  /* to the right */
-  size_t trash = 8 - n % 8;
-  dest->buf[n / 8] = dest->buf[n / 8] >> trash << trash;
+  copy_bits(dest->buf, 0, src->buf, start, n);
   dest->len = n;
+  clear_tail(dest);
+  STAT_END(BITBUF_STAT_SLICE, width / 8);
 }
 
 unsigned char bitbuf_getbit(const bitbuf *bb, size_t n) {
   if (n > bb->len) die("getbit: Out of bounds");
 
-  size_t bytepos = n / 8;
-  size_t bitpos = 7 - n % 8;
-  return getbit(bb->buf[bytepos], bitpos);
+  return (bb->buf[n / 8] & BIT_MASK(n)) != 0;
 }
 
 void bitbuf_setbit(bitbuf *bb, size_t n, int bit) {
   if (n > bb->len) die("setbit: Out of bounds");
 
   size_t bytepos = n / 8;
-  size_t bitpos = 7 - n % 8;
-  unsigned char mask = 0x1 << bitpos;
+  unsigned char mask = BIT_MASK(n);
 
   if (bit)
     bb->buf[bytepos] |= mask;
@@ -241,14 +1093,225 @@ void bitbuf_setbit(bitbuf *bb, size_t n, int bit) {
     bb->buf[bytepos] &= ~mask;
 }
 
+/* Range fills: masked edge bytes around a plain run of whole bytes */
+enum { FILL_CLEAR, FILL_SET, FILL_FLIP };
+
+static inline void fill_byte(unsigned char *p, unsigned char m, int how) {
+  if (how == FILL_SET)
+    *p |= m;
+  else if (how == FILL_CLEAR)
+    *p &= ~m;
+  else
+    *p ^= m;
+}
+
+static void fill_range(bitbuf *bb, size_t start, size_t n, int how) {
+  if (start > bb->len || n > bb->len - start) die("range: Out of bounds");
+  if (!n) return;
+
+  unsigned char *p = bb->buf;
+  size_t first = start / 8;
+  size_t last = (start + n - 1) / 8;
+  unsigned char head = ORD(0xff >> start % 8);
+  unsigned char tail = ORD(0xff << (7 - (start + n - 1) % 8));
+  if (first == last) {
+    fill_byte(p + first, head & tail, how);
+    return;
+  }
+
+  fill_byte(p + first, head, how);
+  fill_byte(p + last, tail, how);
+  size_t i;
+  if (how == FILL_FLIP)
+    for (i = first + 1; i < last; ++i) p[i] = ~p[i];
+  else
+    memset(p + first + 1, how == FILL_SET ? 0xff : 0, last - first - 1);
+}
+
+void bitbuf_set_range(bitbuf *bb, size_t start, size_t n) {
+  fill_range(bb, start, n, FILL_SET);
+}
+
+void bitbuf_clear_range(bitbuf *bb, size_t start, size_t n) {
+  fill_range(bb, start, n, FILL_CLEAR);
+}
+
+void bitbuf_flip_range(bitbuf *bb, size_t start, size_t n) {
+  fill_range(bb, start, n, FILL_FLIP);
+}
+
+void bitbuf_set_stride(bitbuf *bb, size_t start, size_t step, size_t count) {
+  if (!count) return;
+  if (!step) die("set_stride: Step should be positive");
+  if (start >= bb->len || count - 1 > (bb->len - 1 - start) / step)
+    die("set_stride: Out of bounds");
+
+  unsigned char *p = bb->buf;
+  size_t end = start + (count - 1) * step;
+  size_t pos = start, k;
+
+  /* Up to 64 bits apart, OR a repeating pattern into whole words. Its phase
+   * within each word is the distance to the first bit due there
+   */
+  if (step <= 64) {
+    uint64_t pat = 0, m;
+    size_t w = pos / 8, nb = BYTE_LEN(bb->len), wend;
+    for (k = 0; k < 64; k += step) pat |= 1ULL << (63 - k);
+
+    for (; w + 8 <= nb && pos <= end; w += 8) {
+      wend = w * 8 + 63;
+      m = pat >> (pos - w * 8);
+      if (end < wend) m &= ~0ULL << (wend - end);
+      stword(p + w, ldword(p + w) | m);
+      pos += ((wend - pos) / step + 1) * step;
+    }
+  }
+  for (; pos <= end; pos += step) p[pos / 8] |= BIT_MASK(pos);
+}
+
+/* Concurrent bitmaps
+ * Bits are updated with atomic RMWs on the aligned 64-bit word holding
+ * them. A stream word (first bit on top) is put into memory order the way
+ * stword() would store it
+ */
+#define CONCURRENT_ALIGN 64
+
+static inline uint64_t mem_order(uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+#ifdef BITBUF_LSB_FIRST
+  w = rev_bytes(w);
+#endif
+  return w;
+}
+
+static inline uint64_t *atomic_word(const bitbuf *bb, size_t n,
+                                    const char *fn) {
+  if ((uintptr_t)bb->buf % 8 || bb->alloc % 64)
+    die("%s: Buffer is not word aligned, use bitbuf_init_concurrent", fn);
+  if (n >= bb->len) die("%s: Out of bounds", fn);
+  return (uint64_t *)bb->buf + n / 64;
+}
+
+void bitbuf_init_concurrent(bitbuf *bb, size_t s) {
+  size_t n = (BYTE_LEN(s) + CONCURRENT_ALIGN - 1) / CONCURRENT_ALIGN *
+             CONCURRENT_ALIGN;
+  if (!n) n = CONCURRENT_ALIGN;
+  bb->buf = (unsigned char *)aligned_alloc(CONCURRENT_ALIGN, n);
+  if (bb->buf == NULL) die("init_concurrent: Could not allocate %zu bytes", n);
+  memset(bb->buf, 0, n);
+  bb->len = s;
+  bb->alloc = n * 8;
+  STAT_ALLOC(bb->alloc);
+}
+
+void bitbuf_setbit_atomic(bitbuf *bb, size_t n, int order) {
+  uint64_t *w = atomic_word(bb, n, "setbit_atomic");
+  __atomic_fetch_or(w, mem_order(1ULL << (63 - n % 64)), order);
+}
+
+int bitbuf_test_and_set(bitbuf *bb, size_t n, int order) {
+  uint64_t *w = atomic_word(bb, n, "test_and_set");
+  uint64_t m = mem_order(1ULL << (63 - n % 64));
+  return (__atomic_fetch_or(w, m, order) & m) != 0;
+}
+
+int bitbuf_test_and_clear(bitbuf *bb, size_t n, int order) {
+  uint64_t *w = atomic_word(bb, n, "test_and_clear");
+  uint64_t m = mem_order(1ULL << (63 - n % 64));
+  return (__atomic_fetch_and(w, ~m, order) & m) != 0;
+}
+
+void bitbuf_or_atomic_range(bitbuf *dest, size_t pos, const bitbuf *src,
+                            int order) {
+  if (!src->len) return;
+  if (pos > dest->len || src->len > dest->len - pos)
+    die("or_atomic_range: Out of bounds");
+
+  size_t i, d, k;
+  uint64_t v;
+  for (i = 0; i < src->len; i += k) {
+    d = pos + i;
+    k = szmin(64 - d % 64, src->len - i);
+    v = load_bits(src->buf, i, k, src->len) >> d % 64;
+    if (v)
+      __atomic_fetch_or(atomic_word(dest, d, "or_atomic_range"), mem_order(v),
+                        order);
+  }
+}
+
+/* Bit scans
+ * Words are loaded from 64-bit aligned stream positions with the first bit on
+ * top, so count-leading-zeros finds the lowest position in a word
+ */
+static inline uint64_t scan_word(const bitbuf *bb, size_t pos) {
+  return load_bits(bb->buf, pos, szmin(64, bb->len - pos), bb->len);
+}
+
+size_t bitbuf_find_next_one(const bitbuf *bb, size_t from) {
+  if (from >= bb->len) return bb->len;
+
+  size_t pos = from - from % 64;
+  uint64_t x = scan_word(bb, pos) & ~0ULL >> from % 64;
+  while (!x) {
+    if ((pos += 64) >= bb->len) return bb->len;
+    x = scan_word(bb, pos);
+  }
+  return pos + __builtin_clzll(x);
+}
+
+size_t bitbuf_find_next_zero(const bitbuf *bb, size_t from) {
+  if (from >= bb->len) return bb->len;
+
+  size_t pos = from - from % 64, k;
+  uint64_t x = ~scan_word(bb, pos) & ~0ULL >> from % 64;
+  for (;;) {
+    /* Bits past the end are not zeros */
+    k = bb->len - pos;
+    if (k < 64) x &= ~(~0ULL >> k);
+    if (x) return pos + __builtin_clzll(x);
+    if ((pos += 64) >= bb->len) return bb->len;
+    x = ~scan_word(bb, pos);
+  }
+}
+
+size_t bitbuf_find_prev_one(const bitbuf *bb, size_t from) {
+  if (!bb->len) return 0;
+  if (from >= bb->len) from = bb->len - 1;
+
+  size_t pos = from - from % 64;
+  uint64_t x = scan_word(bb, pos) & ~0ULL << (63 - from % 64);
+  while (!x) {
+    if (!pos) return bb->len;
+    pos -= 64;
+    x = scan_word(bb, pos);
+  }
+  return pos + 63 - __builtin_ctzll(x);
+}
+
+size_t bitbuf_decode_ones(const bitbuf *bb, uint64_t *out, size_t cap) {
+  size_t pos, n = 0;
+  uint64_t x;
+  int c;
+
+  for (pos = 0; pos < bb->len && n < cap; pos += 64) {
+    for (x = scan_word(bb, pos); x && n < cap; x ^= 1ULL << (63 - c)) {
+      c = __builtin_clzll(x);
+      out[n++] = pos + c;
+    }
+  }
+  return n;
+}
+
 unsigned char bitbuf_getbyte(const bitbuf *bb, size_t pos, size_t offset) {
   if ((pos + 1) * 8 + offset > bb->len) die("getbyte: Out of bounds");
 
   unsigned char win[2];
   size_t trash = 8 - offset;
 
-  win[0] = bb->buf[pos] << offset;
-  win[1] = bb->buf[pos + 1] >> trash;
+  win[0] = TO_START(bb->buf[pos], offset);
+  win[1] = TO_END(bb->buf[pos + 1], trash);
   return win[0] | win[1];
 }
 
@@ -256,15 +1319,14 @@ void bitbuf_setbyte(bitbuf *bb, size_t pos, size_t offset, unsigned char byte) {
   if ((pos + 1) * 8 + offset > bb->len) die("setbyte: Out of bounds");
 
   size_t trash = 8 - offset;
+  unsigned char head = ORD(0xff << trash);
 
-  bb->buf[pos] &= ~0 << trash;
-  bb->buf[pos] |= byte >> offset;
-  bb->buf[pos + 1] &= ~(~0 << trash);
-  bb->buf[pos + 1] |= byte << trash;
+  bb->buf[pos] = (bb->buf[pos] & head) | TO_END(byte, offset);
+  bb->buf[pos + 1] = (bb->buf[pos + 1] & ~head) | TO_START(byte, trash);
 }
 
 void bitbuf_addbyte(bitbuf *bb, unsigned char byte) {
-  if (bb->len + 8 > bb->alloc) bitbuf_grow(bb, bb->len * 2);
+  if (bb->len + 8 > bb->alloc) bitbuf_grow(bb, bb->len + 8);
 
   size_t pad = bb->len % 8;
   size_t bytepos = bb->len / 8;
@@ -272,8 +1334,8 @@ void bitbuf_addbyte(bitbuf *bb, unsigned char byte) {
   if (!pad) {
     bb->buf[bytepos] = byte;
   } else {
-    bb->buf[bytepos] |= byte >> pad;
-    bb->buf[bytepos + 1] = byte << (8 - pad);
+    bb->buf[bytepos] |= TO_END(byte, pad);
+    bb->buf[bytepos + 1] = TO_START(byte, 8 - pad);
   }
 
   bb->len += 8;
@@ -287,28 +1349,11 @@ void bitbuf_addbit(bitbuf *bb, int bit) {
 }
 
 void bitbuf_addbuf(bitbuf *dest, const bitbuf *src) {
-  if (src->len > dest->alloc - dest->len) bitbuf_grow(dest, src->len);
-
-  size_t pad, trash;
-  pad = dest->len % 8;
-  trash = min((8 - pad), src->len);
-
-  size_t copycnt = src->len;
-  bitbuf fresh = BITBUF_INIT;
+  STAT_BEGIN();
+  if (src->len > bitbuf_avail(dest)) bitbuf_grow(dest, src->len + dest->len);
 
-  if (pad) {
-    dest->buf[dest->len / 8] |= src->buf[0] >> pad;
-    bitbuf_copy(&fresh, src);
-    bitbuf_lsh(&fresh, trash);
-    copycnt -= trash;
-  } else {
-    fresh = *src;
-  }
-
-  memcpy(dest->buf + BYTE_LEN(dest->len), fresh.buf, BYTE_LEN(copycnt));
-  dest->len += fresh.len;
-
-  if (pad) bitbuf_release(&fresh);
+  bitbuf_copy_bits(dest, dest->len, src, 0, src->len);
+  STAT_END(BITBUF_STAT_ADDBUF, BYTE_LEN(src->len));
 }
 
 void bitbuf_reverse(bitbuf *bb, size_t start, size_t n) {
@@ -323,14 +1368,106 @@ void bitbuf_reverse(bitbuf *bb, size_t start, size_t n) {
   }
 }
 
+struct reverse_ctx {
+  bitbuf *bb;
+  size_t n;
+};
+
+static void reverse_range(size_t lo, size_t hi, void *ctx) {
+  struct reverse_ctx *c = (struct reverse_ctx *)ctx;
+  size_t i;
+  for (i = lo; i < hi; ++i) bitbuf_reverse(c->bb, i * c->n, c->n);
+}
+
 void bitbuf_reverse_all(bitbuf *bb, size_t n) {
+  if (!n) die("reverse_all: Unit length should be positive");
+  STAT_BEGIN();
+  /* Chunks of 8 units start on a byte, so no two threads share one */
+  size_t units = (bb->len + n - 1) / n;
+  struct reverse_ctx c = {bb, n};
+  par_run(units, par_chunk(units, 8, BYTE_LEN(bb->len)), reverse_range, &c);
+  STAT_END(BITBUF_STAT_REVERSE, BYTE_LEN(bb->len));
+}
+
+static void flip_range(size_t lo, size_t hi, void *ctx) {
+  unsigned char *p = (unsigned char *)ctx;
   size_t i;
-  for (i = 0; i < bb->len; i += n) bitbuf_reverse(bb, i, n);
+  uint64_t w;
+  for (i = lo; i + 8 <= hi; i += 8) {
+    memcpy(&w, p + i, 8);
+    w = rev_bytes(w);
+    memcpy(p + i, &w, 8);
+  }
+  for (; i < hi; ++i) p[i] = rev_bytes(p[i]);
+}
+
+void bitbuf_flip_order(bitbuf *bb) {
+  STAT_BEGIN();
+  /* Whole bytes, the last one included: the other order kept its bits at
+   * the opposite end of that byte
+   */
+  size_t nbytes = BYTE_LEN(bb->len);
+  par_run(nbytes, par_chunk(nbytes, 64, nbytes), flip_range, bb->buf);
+  clear_tail(bb);
+  STAT_END(BITBUF_STAT_REVERSE, nbytes);
+}
+
+/* Sub-byte shifts of a chunk read one byte of the neighbouring chunk. Those
+ * bytes are saved up front so chunks can shift in place in any order
+ */
+struct shift_ctx {
+  unsigned char *p;
+  size_t nbytes;
+  size_t rem;
+  size_t chunk;
+  unsigned char *edge;
+};
+
+static void lsh_range(size_t lo, size_t hi, void *ctx) {
+  struct shift_ctx *c = (struct shift_ctx *)ctx;
+  unsigned char *p = c->p;
+  unsigned char next = hi < c->nbytes ? c->edge[lo / c->chunk] : 0;
+  size_t i, rem = c->rem;
+
+  for (i = lo; i + 1 < hi; ++i)
+    p[i] = TO_START(p[i], rem) | TO_END(p[i + 1], 8 - rem);
+  p[i] = TO_START(p[i], rem) | TO_END(next, 8 - rem);
+}
+
+static void rsh_range(size_t lo, size_t hi, void *ctx) {
+  struct shift_ctx *c = (struct shift_ctx *)ctx;
+  unsigned char *p = c->p;
+  unsigned char prev = lo ? c->edge[lo / c->chunk] : 0;
+  size_t i, rem = c->rem;
+
+  for (i = hi - 1; i > lo; --i)
+    p[i] = TO_END(p[i], rem) | TO_START(p[i - 1], 8 - rem);
+  p[lo] = TO_END(p[lo], rem) | TO_START(prev, 8 - rem);
+}
+
+static void shift_bytes(unsigned char *p, size_t nbytes, size_t rem,
+                        int left) {
+  if (!nbytes || !rem) return;
+
+  size_t chunk = par_chunk(nbytes, 64, nbytes);
+  size_t k, nchunks = (nbytes + chunk - 1) / chunk;
+  unsigned char one;
+  struct shift_ctx c = {p, nbytes, rem, chunk, &one};
+
+  if (nchunks > 1) {
+    c.edge = (unsigned char *)malloc(nchunks);
+    if (c.edge == NULL) die("shift: Could not allocate chunk edges");
+    for (k = 1; k < nchunks; ++k)
+      c.edge[left ? k - 1 : k] = left ? p[k * chunk] : p[k * chunk - 1];
+  }
+  par_run(nbytes, chunk, left ? lsh_range : rsh_range, &c);
+  if (nchunks > 1) free(c.edge);
 }
 
 void bitbuf_lsh(bitbuf *bb, size_t n) {
   /* Throw away bytes that would have been lost anyway
    * with shifts greater than 8 */
+  STAT_BEGIN();
 
   if (n > bb->len) {
     memset(bb->buf, 0, BYTE_LEN(bb->len));
@@ -343,23 +1480,12 @@ void bitbuf_lsh(bitbuf *bb, size_t n) {
     memset(bb->buf + BYTE_LEN(bb->len) - skipcnt, 0, skipcnt);
   }
 
-  size_t rem = n % 8;
-  if (rem) {
-    size_t trash = 8 - rem;
-    unsigned char trail;
-
-    size_t i;
-    for (i = 0; i < BYTE_LEN(bb->len) - 1; ++i) {
-      trail = bb->buf[i + 1] >> trash;
-      bb->buf[i] <<= rem;
-      bb->buf[i] |= trail;
-    }
-
-    bb->buf[i] <<= rem;
-  }
+  shift_bytes(bb->buf, BYTE_LEN(bb->len), n % 8, 1);
+  STAT_END(BITBUF_STAT_LSH, BYTE_LEN(bb->len));
 }
 
 void bitbuf_rsh(bitbuf *bb, size_t n) {
+  STAT_BEGIN();
   if (n > bb->len) {
     memset(bb->buf, 0, BYTE_LEN(bb->len));
     n = 0;
@@ -371,20 +1497,8 @@ void bitbuf_rsh(bitbuf *bb, size_t n) {
     memset(bb->buf, 0, skipcnt);
   }
 
-  size_t rem = n - (skipcnt * 8);
-  if (rem) {
-    size_t trash = 8 - rem;
-    unsigned char trail;
-
-    int i;
-    for (i = BYTE_LEN(bb->len) - 1; i > 0; --i) {
-      trail = bb->buf[i - 1] << trash;
-      bb->buf[i] >>= rem;
-      bb->buf[i] |= trail;
-    }
-
-    bb->buf[0] >>= rem;
-  }
+  shift_bytes(bb->buf, BYTE_LEN(bb->len), n - (skipcnt * 8), 0);
+  STAT_END(BITBUF_STAT_RSH, BYTE_LEN(bb->len));
 }
 
 void bitbuf_align(bitbuf *a, bitbuf *b) {
@@ -398,17 +1512,32 @@ void bitbuf_align(bitbuf *a, bitbuf *b) {
   bitbuf_rsh(sm, diff);
 }
 
+struct op_ctx {
+  const unsigned char *a;
+  const unsigned char *b;
+  unsigned char *res;
+  OperatorPtr op;
+};
+
+static void op_range(size_t lo, size_t hi, void *ctx) {
+  struct op_ctx *c = (struct op_ctx *)ctx;
+  size_t i;
+  for (i = lo; i < hi; ++i) c->res[i] = (*c->op)(c->a[i], c->b[i]);
+}
+
 void bitbuf_op(const bitbuf *a, const bitbuf *b, bitbuf *res, OperatorPtr op) {
   if (a->len != b->len)
     die("op: Buffers should be of same length to perform the operation");
 
+  STAT_BEGIN();
   if (res->alloc <= a->len) bitbuf_grow(res, a->len - res->alloc + 8);
 
-  size_t i;
-  for (i = 0; i < BYTE_LEN(a->len); ++i)
-    res->buf[i] = (*op)(a->buf[i], b->buf[i]);
+  size_t n = BYTE_LEN(a->len);
+  struct op_ctx c = {a->buf, b->buf, res->buf, op};
+  par_run(n, par_chunk(n, 64, n * 3), op_range, &c);
 
   res->len = a->len;
+  STAT_END(BITBUF_STAT_OP, BYTE_LEN(a->len) * 3);
 }
 
 static unsigned char xor (unsigned char a, unsigned char b) {
@@ -440,8 +1569,8 @@ void bitbuf_plus(const bitbuf *a, const bitbuf *b, bitbuf *res) {
   int i, sum, carry;
   carry = 0;
   for (i = BYTE_LEN(lval.len) - 1; i >= 0; --i) {
-    sum = lval.buf[i] + rval.buf[i] + carry;
-    res->buf[i] = sum;
+    sum = ORD(lval.buf[i]) + ORD(rval.buf[i]) + carry;
+    res->buf[i] = ORD(sum);
     carry = getbit(sum, 8);
   }
 
@@ -459,6 +1588,1304 @@ void bitbuf_plus(const bitbuf *a, const bitbuf *b, bitbuf *res) {
   bitbuf_release(&rval);
 }
 
+/* Set bits of a mask up to its length, whatever the rest of the last byte
+ * holds
+ */
+static size_t mask_weight(const bitbuf *mask) {
+  size_t n = bitbuf_weight(mask);
+  if (mask->len % 8)
+    n -= popcnt(mask->buf[mask->len / 8] & ~ORD(0xff << (8 - mask->len % 8)));
+  return n;
+}
+
+void bitbuf_extract_mask(bitbuf *dest, const bitbuf *src, const bitbuf *mask) {
+  if (src->len != mask->len)
+    die("extract_mask: Buffers should be of same length");
+  pthread_once(&pext_once, pext_init);
+
+  size_t n = mask_weight(mask);
+  if (n > dest->alloc) bitbuf_grow(dest, n - dest->alloc);
+
+  size_t i, k;
+  uint64_t m;
+  bitwriter w;
+  bw_init(&w, dest->buf);
+
+  for (i = 0; i + 64 <= src->len; i += 64) {
+    m = ldword(mask->buf + i / 8);
+    bw_put(&w, pext(ldword(src->buf + i / 8), m), __builtin_popcountll(m));
+  }
+  if ((k = src->len - i)) {
+    m = getbits(mask->buf, i, k);
+    bw_put(&w, pext(getbits(src->buf, i, k), m), __builtin_popcountll(m));
+  }
+  bw_flush(&w);
+
+  dest->len = n;
+  clear_tail(dest);
+}
+
+void bitbuf_deposit_mask(bitbuf *dest, const bitbuf *src, const bitbuf *mask) {
+  pthread_once(&pext_once, pext_init);
+  if (mask_weight(mask) > src->len)
+    die("deposit_mask: Source shorter than the weight of the mask");
+  if (mask->len > dest->alloc) bitbuf_grow(dest, mask->len - dest->alloc);
+
+  size_t i, k, cnt, pos;
+  uint64_t m;
+  bitwriter w;
+  bw_init(&w, dest->buf);
+
+  for (i = pos = 0; i < mask->len; i += k, pos += cnt) {
+    k = szmin(64, mask->len - i);
+    m = k == 64 ? ldword(mask->buf + i / 8) : getbits(mask->buf, i, k);
+    cnt = __builtin_popcountll(m);
+    bw_put(&w, pdep(getbits(src->buf, pos, cnt), m), k);
+  }
+  bw_flush(&w);
+
+  dest->len = mask->len;
+  clear_tail(dest);
+}
+
+/* Morton-style helpers: gather every k-th bit of a word (k = 2, 4 or 8),
+ * starting from the least significant one, into the low 64 / k bits and the
+ * inverse
+ */
+static inline uint64_t compact(uint64_t x, size_t k) {
+  switch (k) {
+    case 2:
+      x &= 0x5555555555555555ULL;
+      x = (x | x >> 1) & 0x3333333333333333ULL;
+      x = (x | x >> 2) & 0x0f0f0f0f0f0f0f0fULL;
+      x = (x | x >> 4) & 0x00ff00ff00ff00ffULL;
+      x = (x | x >> 8) & 0x0000ffff0000ffffULL;
+      return (x | x >> 16) & 0xffffffffULL;
+    case 4:
+      x &= 0x1111111111111111ULL;
+      x = (x | x >> 3) & 0x0303030303030303ULL;
+      x = (x | x >> 6) & 0x000f000f000f000fULL;
+      x = (x | x >> 12) & 0x000000ff000000ffULL;
+      return (x | x >> 24) & 0xffffULL;
+    default:
+      x &= 0x0101010101010101ULL;
+      x = (x | x >> 7) & 0x0003000300030003ULL;
+      x = (x | x >> 14) & 0x0000000f0000000fULL;
+      return (x | x >> 28) & 0xffULL;
+  }
+}
+
+static inline uint64_t spread(uint64_t x, size_t k) {
+  switch (k) {
+    case 2:
+      x &= 0xffffffffULL;
+      x = (x | x << 16) & 0x0000ffff0000ffffULL;
+      x = (x | x << 8) & 0x00ff00ff00ff00ffULL;
+      x = (x | x << 4) & 0x0f0f0f0f0f0f0f0fULL;
+      x = (x | x << 2) & 0x3333333333333333ULL;
+      return (x | x << 1) & 0x5555555555555555ULL;
+    case 4:
+      x &= 0xffffULL;
+      x = (x | x << 24) & 0x000000ff000000ffULL;
+      x = (x | x << 12) & 0x000f000f000f000fULL;
+      x = (x | x << 6) & 0x0303030303030303ULL;
+      return (x | x << 3) & 0x1111111111111111ULL;
+    default:
+      x &= 0xffULL;
+      x = (x | x << 28) & 0x0000000f0000000fULL;
+      x = (x | x << 14) & 0x0003000300030003ULL;
+      return (x | x << 7) & 0x0101010101010101ULL;
+  }
+}
+
+void bitbuf_deinterleave(const bitbuf *src, size_t k, bitbuf *out[]) {
+  if (k == 0) die("deinterleave: Need at least one channel");
+
+  size_t c, i = 0;
+  bitwriter *w = (bitwriter *)malloc(k * sizeof(bitwriter));
+  if (w == NULL) die("deinterleave: Could not allocate %zu channels", k);
+  for (c = 0; c < k; ++c) {
+    size_t n = (src->len + k - 1 - c) / k;
+    if (n > out[c]->alloc) bitbuf_grow(out[c], n - out[c]->alloc);
+    out[c]->len = n;
+    bw_init(&w[c], out[c]->buf);
+  }
+
+  /* A channel keeps its phase from word to word when k divides 64 */
+  if (k == 2 || k == 4 || k == 8) {
+    for (; i + 64 <= src->len; i += 64) {
+      uint64_t x = ldword(src->buf + i / 8);
+      for (c = 0; c < k; ++c)
+        bw_put(&w[c], compact(x >> (k - 1 - c), k), 64 / k);
+    }
+  }
+  for (; i < src->len; ++i) bw_put(&w[i % k], getbits(src->buf, i, 1), 1);
+
+  for (c = 0; c < k; ++c) {
+    bw_flush(&w[c]);
+    clear_tail(out[c]);
+  }
+  free(w);
+}
+
+void bitbuf_interleave(bitbuf *dest, bitbuf *const in[], size_t k) {
+  if (k == 0) die("interleave: Need at least one channel");
+
+  size_t c, t, i = 0, len = in[0]->len;
+  for (c = 1; c < k; ++c)
+    if (in[c]->len != len)
+      die("interleave: Buffers should be of same length");
+  if (len * k > dest->alloc) bitbuf_grow(dest, len * k - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+
+  /* Take a word from every channel and emit k whole words */
+  if (k == 2 || k == 4 || k == 8) {
+    size_t step = 64 / k;
+    uint64_t x[8], out;
+    for (; i + 64 <= len; i += 64) {
+      for (c = 0; c < k; ++c) x[c] = ldword(in[c]->buf + i / 8);
+      for (t = 0; t < k; ++t) {
+        out = 0;
+        for (c = 0; c < k; ++c)
+          out |= spread(x[c] >> (64 - step * (t + 1)), k) << (k - 1 - c);
+        bw_put(&w, out, 64);
+      }
+    }
+  }
+  for (; i < len; ++i)
+    for (c = 0; c < k; ++c) bw_put(&w, getbits(in[c]->buf, i, 1), 1);
+  bw_flush(&w);
+
+  dest->len = len * k;
+  clear_tail(dest);
+}
+
+/* Fixed-width packing
+ * Eight values take exactly `width` bytes, so every group of eight starts
+ * on the same bit phase and its shifts depend on the width alone. The
+ * group kernels are inlined once per width up to 32, with every shift and
+ * word index a constant; wider values share a generic copy. A group is
+ * built in words with the first value on top (at the bottom under
+ * BITBUF_LSB_FIRST, where that is plain little-endian bit packing) and
+ * moves through the bitwriter / load_bits(), so any starting bit works
+ */
+#define PACK_GROUP 8
+#define PACK_CHUNK 64
+
+/* A group word to / from the order of the stream, both ways */
+static inline uint64_t pack_order(uint64_t w) {
+#ifdef BITBUF_LSB_FIRST
+  w = rev_bytes(__builtin_bswap64(w));
+#endif
+  return w;
+}
+
+static inline uint64_t pack_mask(size_t w) {
+  return w == 64 ? ~0ULL : (1ULL << w) - 1;
+}
+
+static inline __attribute__((always_inline)) void pack_groups(
+    bitwriter *wr, const uint64_t *v, size_t groups, size_t w) {
+  size_t g, j, o, k, s, full = w / 8, rem = w % 8 * 8;
+  uint64_t x;
+  for (g = 0; g < groups; ++g, v += PACK_GROUP) {
+    uint64_t W[PACK_GROUP] = {0};
+#pragma GCC unroll 8
+    for (j = 0; j < PACK_GROUP; ++j) {
+      o = j * w, k = o / 64, s = o % 64;
+      x = v[j] & pack_mask(w);
+#ifdef BITBUF_LSB_FIRST
+      W[k] |= x << s;
+      if (s + w > 64) W[k + 1] |= x >> (64 - s);
+#else
+      x <<= 64 - w;
+      W[k] |= x >> s;
+      if (s + w > 64) W[k + 1] |= x << (64 - s);
+#endif
+    }
+    for (k = 0; k < full; ++k) bw_put(wr, pack_order(W[k]), 64);
+    if (rem) bw_put(wr, pack_order(W[full]) >> (64 - rem), rem);
+  }
+}
+
+static inline __attribute__((always_inline)) void unpack_groups(
+    const unsigned char *p, size_t pos, size_t limit, uint64_t *v,
+    size_t groups, size_t w) {
+  size_t g, j, o, k, s, full = w / 8, rem = w % 8 * 8;
+  uint64_t x, W[PACK_GROUP];
+  for (g = 0; g < groups; ++g, v += PACK_GROUP, pos += PACK_GROUP * w) {
+    for (k = 0; k < full; ++k)
+      W[k] = pack_order(load_bits(p, pos + 64 * k, 64, limit));
+    if (rem) W[full] = pack_order(load_bits(p, pos + 64 * full, rem, limit));
+#pragma GCC unroll 8
+    for (j = 0; j < PACK_GROUP; ++j) {
+      o = j * w, k = o / 64, s = o % 64;
+#ifdef BITBUF_LSB_FIRST
+      x = W[k] >> s;
+      if (s + w > 64) x |= W[k + 1] << (64 - s);
+      v[j] = x & pack_mask(w);
+#else
+      x = W[k] << s;
+      if (s + w > 64) x |= W[k + 1] >> (64 - s);
+      v[j] = x >> (64 - w);
+#endif
+    }
+  }
+}
+
+/* Run `call(w)` with `w` a constant when it is 32 or less */
+#define PACK_CASE(k, call) \
+  case k:                  \
+    call(k);               \
+    return;
+#define PACK_CASES(b, call) \
+  PACK_CASE(b + 1, call)    \
+  PACK_CASE(b + 2, call) PACK_CASE(b + 3, call) PACK_CASE(b + 4, call)
+#define PACK_SWITCH(w, call)                                        \
+  switch (w) {                                                      \
+    PACK_CASES(0, call) PACK_CASES(4, call) PACK_CASES(8, call)     \
+    PACK_CASES(12, call) PACK_CASES(16, call) PACK_CASES(20, call)  \
+    PACK_CASES(24, call) PACK_CASES(28, call)                       \
+  }                                                                 \
+  call(w)
+
+static void pack_width(bitwriter *wr, const uint64_t *v, size_t groups,
+                       size_t w) {
+#define PACK_CALL(k) pack_groups(wr, v, groups, k)
+  PACK_SWITCH(w, PACK_CALL);
+#undef PACK_CALL
+}
+
+static void unpack_width(const unsigned char *p, size_t pos, size_t limit,
+                         uint64_t *v, size_t groups, size_t w) {
+#define PACK_CALL(k) unpack_groups(p, pos, limit, v, groups, k)
+  PACK_SWITCH(w, PACK_CALL);
+#undef PACK_CALL
+}
+
+/* One value of `w` bits at `pos` */
+static inline uint64_t unpack_one(const unsigned char *p, size_t pos,
+                                  size_t w, size_t limit) {
+  uint64_t x = load_bits(p, pos, w, limit);
+#ifdef BITBUF_LSB_FIRST
+  return pack_order(x);
+#else
+  return x >> (64 - w);
+#endif
+}
+
+static void pack(bitbuf *bb, const void *vals, int wide, size_t n,
+                 size_t width) {
+  if (width == 0 || width > (wide ? 64u : 32u))
+    die("pack: Width should be between 1 and %d", wide ? 64 : 32);
+
+  size_t i, j, m, need = bb->len + n * width;
+  uint64_t v[PACK_CHUNK];
+  if (need > bb->alloc) bitbuf_grow(bb, need - bb->alloc);
+
+  /* Pick up the bits already in the last byte */
+  bitwriter wr;
+  bw_init(&wr, bb->buf + bb->len / 8);
+  wr.fill = bb->len % 8;
+  if (wr.fill)
+    wr.acc = (uint64_t)ORD(bb->buf[bb->len / 8]) << 56 & ~(~0ULL >> wr.fill);
+
+  for (i = 0; i < n; i += m) {
+    m = szmin(n - i, PACK_CHUNK);
+    if (wide)
+      memcpy(v, (const uint64_t *)vals + i, m * 8);
+    else
+      for (j = 0; j < m; ++j) v[j] = ((const uint32_t *)vals)[i + j];
+
+    pack_width(&wr, v, m / PACK_GROUP, width);
+    for (j = m - m % PACK_GROUP; j < m; ++j) {
+#ifdef BITBUF_LSB_FIRST
+      bw_put(&wr, pack_order(v[j]) >> (64 - width), width);
+#else
+      bw_put(&wr, v[j], width);
+#endif
+    }
+  }
+  bw_flush(&wr);
+
+  bb->len = need;
+  clear_tail(bb);
+}
+
+static void unpack(const bitbuf *bb, size_t pos, void *vals, int wide,
+                   size_t n, size_t width) {
+  if (width == 0 || width > (wide ? 64u : 32u))
+    die("unpack: Width should be between 1 and %d", wide ? 64 : 32);
+  if (pos > bb->len || n > (bb->len - pos) / width)
+    die("unpack: Values should be within the buffer");
+
+  size_t i, j, m;
+  uint64_t v[PACK_CHUNK];
+  for (i = 0; i < n; i += m, pos += m * width) {
+    m = szmin(n - i, PACK_CHUNK);
+    unpack_width(bb->buf, pos, bb->len, v, m / PACK_GROUP, width);
+    for (j = m - m % PACK_GROUP; j < m; ++j)
+      v[j] = unpack_one(bb->buf, pos + j * width, width, bb->len);
+
+    if (wide)
+      memcpy((uint64_t *)vals + i, v, m * 8);
+    else
+      for (j = 0; j < m; ++j) ((uint32_t *)vals)[i + j] = (uint32_t)v[j];
+  }
+}
+
+void bitbuf_pack_u32(bitbuf *bb, const uint32_t *vals, size_t n,
+                     size_t width) {
+  pack(bb, vals, 0, n, width);
+}
+
+void bitbuf_pack_u64(bitbuf *bb, const uint64_t *vals, size_t n,
+                     size_t width) {
+  pack(bb, vals, 1, n, width);
+}
+
+void bitbuf_unpack_u32(const bitbuf *bb, size_t pos, uint32_t *vals, size_t n,
+                       size_t width) {
+  unpack(bb, pos, vals, 0, n, width);
+}
+
+void bitbuf_unpack_u64(const bitbuf *bb, size_t pos, uint64_t *vals, size_t n,
+                       size_t width) {
+  unpack(bb, pos, vals, 1, n, width);
+}
+
+uint64_t bitbuf_unpack_at(const bitbuf *bb, size_t pos, size_t width,
+                          size_t i) {
+  if (width == 0 || width > 64)
+    die("unpack_at: Width should be between 1 and 64");
+  if (pos > bb->len || i >= (bb->len - pos) / width)
+    die("unpack_at: Value %zu is out of the buffer", i);
+  return unpack_one(bb->buf, pos + i * width, width, bb->len);
+}
+
+/* Line codes
+ * HDLC stuffing runs a byte at a time through tables indexed by the run of
+ * ones carried in from the previous byte. NRZI is a prefix XOR within a
+ * word, and Manchester is the 2-way spread / compact used by interleave
+ */
+struct hdlc_step {
+  uint16_t bits; /* output, the last of `n` bits in the LSB */
+  uint8_t n;
+  uint8_t next; /* ones in a row after the byte */
+  uint8_t bad;  /* runs of six ones found while unstuffing */
+};
+
+static struct hdlc_step hdlc_stuff_tbl[5][256];
+static struct hdlc_step hdlc_unstuff_tbl[6][256];
+static pthread_once_t hdlc_once = PTHREAD_ONCE_INIT;
+
+static void hdlc_push(struct hdlc_step *e, int b) {
+  e->bits = e->bits << 1 | b;
+  e->n++;
+}
+
+/* Feed one bit with `e->next` ones already in a row */
+static void hdlc_stuff_bit(struct hdlc_step *e, int b) {
+  hdlc_push(e, b);
+  e->next = b ? e->next + 1 : 0;
+  if (e->next == 5) {
+    hdlc_push(e, 0);
+    e->next = 0;
+  }
+}
+
+static void hdlc_unstuff_bit(struct hdlc_step *e, int b) {
+  if (e->next == 5) {
+    /* After five ones only a stuffed 0 is valid; a 1 is a flag or abort */
+    if (b) {
+      hdlc_push(e, 1);
+      e->bad++;
+    }
+    e->next = 0;
+    return;
+  }
+  hdlc_push(e, b);
+  e->next = b ? e->next + 1 : 0;
+}
+
+static void hdlc_init(void) {
+  int st, c, i;
+  for (st = 0; st < 6; ++st) {
+    for (c = 0; c < 256; ++c) {
+      struct hdlc_step u = {0, 0, (uint8_t)st, 0};
+      for (i = 7; i >= 0; --i) hdlc_unstuff_bit(&u, c >> i & 1);
+      hdlc_unstuff_tbl[st][c] = u;
+      if (st == 5) continue;
+
+      struct hdlc_step e = {0, 0, (uint8_t)st, 0};
+      for (i = 7; i >= 0; --i) hdlc_stuff_bit(&e, c >> i & 1);
+      hdlc_stuff_tbl[st][c] = e;
+    }
+  }
+}
+
+static size_t hdlc_run(bitbuf *dest, const bitbuf *src, size_t room,
+                       int stuff) {
+  pthread_once(&hdlc_once, hdlc_init);
+  if (room > dest->alloc) bitbuf_grow(dest, room - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+  size_t i, len = 0, bad = 0;
+  struct hdlc_step e = {0, 0, 0, 0};
+  for (i = 0; i < src->len / 8; ++i) {
+    e = stuff ? hdlc_stuff_tbl[e.next][ORD(src->buf[i])]
+              : hdlc_unstuff_tbl[e.next][ORD(src->buf[i])];
+    bw_put(&w, e.bits, e.n);
+    len += e.n;
+    bad += e.bad;
+  }
+
+  size_t k, rem = src->len % 8;
+  e.bits = e.n = e.bad = 0;
+  for (k = 0; k < rem; ++k) {
+    int b = (src->buf[i] & BIT_MASK(k)) != 0;
+    if (stuff)
+      hdlc_stuff_bit(&e, b);
+    else
+      hdlc_unstuff_bit(&e, b);
+  }
+  bw_put(&w, e.bits, e.n);
+  bw_flush(&w);
+
+  dest->len = len + e.n;
+  clear_tail(dest);
+  return bad + e.bad;
+}
+
+void bitbuf_hdlc_stuff(bitbuf *dest, const bitbuf *src) {
+  hdlc_run(dest, src, src->len + src->len / 5 + 8, 1);
+}
+
+size_t bitbuf_hdlc_unstuff(bitbuf *dest, const bitbuf *src) {
+  return hdlc_run(dest, src, src->len + 8, 0);
+}
+
+void bitbuf_nrzi_encode(bitbuf *dest, const bitbuf *src) {
+  if (src->len + 64 > dest->alloc)
+    bitbuf_grow(dest, src->len + 64 - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+  size_t i, k;
+  uint64_t y, level = 1;
+  for (i = 0; i < src->len; i += 64) {
+    k = szmin(64, src->len - i);
+    /* A 0 toggles the line: each output bit is the parity of the toggles
+     * up to and including it
+     */
+    y = ~load_bits(src->buf, i, k, src->len);
+    y ^= y >> 1;
+    y ^= y >> 2;
+    y ^= y >> 4;
+    y ^= y >> 8;
+    y ^= y >> 16;
+    y ^= y >> 32;
+    y ^= -level;
+    bw_put(&w, y >> (64 - k), k);
+    level = y >> (64 - k) & 1;
+  }
+  bw_flush(&w);
+
+  dest->len = src->len;
+  clear_tail(dest);
+}
+
+void bitbuf_nrzi_decode(bitbuf *dest, const bitbuf *src) {
+  if (src->len + 64 > dest->alloc)
+    bitbuf_grow(dest, src->len + 64 - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+  size_t i, k;
+  uint64_t x, level = 1;
+  for (i = 0; i < src->len; i += 64) {
+    k = szmin(64, src->len - i);
+    x = load_bits(src->buf, i, k, src->len);
+    bw_put(&w, ~(x ^ (x >> 1 | level << 63)) >> (64 - k), k);
+    level = x >> (64 - k) & 1;
+  }
+  bw_flush(&w);
+
+  dest->len = src->len;
+  clear_tail(dest);
+}
+
+void bitbuf_manchester_encode(bitbuf *dest, const bitbuf *src,
+                              int convention) {
+  size_t n = src->len * 2;
+  if (n + 64 > dest->alloc) bitbuf_grow(dest, n + 64 - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+  size_t i, k;
+  uint64_t s, lo = 0x5555555555555555ULL;
+  for (i = 0; i < src->len; i += 32) {
+    k = szmin(32, src->len - i);
+    /* Data bits on the odd positions, their complements on the even ones */
+    s = spread(load_bits(src->buf, i, k, src->len) >> 32, 2);
+    if (convention == BITBUF_MANCHESTER_THOMAS)
+      s = s << 1 | (s ^ lo);
+    else
+      s = (s ^ lo) << 1 | s;
+    bw_put(&w, s >> (64 - 2 * k), 2 * k);
+  }
+  bw_flush(&w);
+
+  dest->len = n;
+  clear_tail(dest);
+}
+
+size_t bitbuf_manchester_decode(bitbuf *dest, const bitbuf *src,
+                                int convention) {
+  size_t n = src->len / 2;
+  if (n + 64 > dest->alloc) bitbuf_grow(dest, n + 64 - dest->alloc);
+
+  bitwriter w;
+  bw_init(&w, dest->buf);
+  size_t i, k, bad = src->len % 2;
+  uint64_t x, lo = 0x5555555555555555ULL;
+  for (i = 0; i < n * 2; i += 64) {
+    k = szmin(64, n * 2 - i);
+    x = load_bits(src->buf, i, k, src->len);
+    /* A symbol is valid when its halves differ; padding pairs are 00 */
+    bad += __builtin_popcountll(~(x ^ x >> 1) & lo) - (64 - k) / 2;
+    x = compact(convention == BITBUF_MANCHESTER_THOMAS ? x >> 1 : x, 2);
+    bw_put(&w, x >> (32 - k / 2), k / 2);
+  }
+  bw_flush(&w);
+
+  dest->len = n;
+  clear_tail(dest);
+  return bad;
+}
+
+/* Transpose a 64x64 bit block in place, row 0 in a[0] and column 0 in the
+ * most significant bit (Hacker's Delight 7-3). Each round swaps the
+ * off-diagonal quarters of ever smaller sub-blocks, down to 2x2
+ */
+static void transpose64(uint64_t a[64]) {
+  uint64_t t, m = 0x00000000ffffffffULL;
+  int j, k;
+  for (j = 32; j != 0; j >>= 1, m ^= m << j) {
+    for (k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+      t = (a[k] ^ (a[k | j] >> j)) & m;
+      a[k] ^= t;
+      a[k | j] ^= t << j;
+    }
+  }
+}
+
+/* Tiles of 64x64 are processed in bands of TRANSPOSE_BAND tiles along the
+ * rows so every destination row receives a whole cache line at a time
+ */
+#define TRANSPOSE_BAND 8
+
+void bitbuf_transpose(bitbuf *dest, const bitbuf *src, size_t rows,
+                      size_t cols) {
+  if (rows * cols != src->len)
+    die("transpose: Buffer is not a %zu x %zu matrix", rows, cols);
+  if (src->len > dest->alloc) bitbuf_grow(dest, src->len - dest->alloc);
+
+  uint64_t a[64];
+  size_t band, r0, c0, r, c, nr, nc;
+  for (band = 0; band < rows; band += 64 * TRANSPOSE_BAND) {
+    for (c0 = 0; c0 < cols; c0 += 64) {
+      nc = szmin(64, cols - c0);
+      for (r0 = band; r0 < rows && r0 < band + 64 * TRANSPOSE_BAND; r0 += 64) {
+        nr = szmin(64, rows - r0);
+        for (r = 0; r < nr; ++r)
+          a[r] = load_bits(src->buf, (r0 + r) * cols + c0, nc, src->len);
+        for (; r < 64; ++r) a[r] = 0;
+
+        transpose64(a);
+        for (c = 0; c < nc; ++c) {
+          size_t pos = (c0 + c) * rows + r0;
+          if (nr == 64 && pos % 8 == 0)
+            stword(dest->buf + pos / 8, a[c]);
+          else
+            putbits(dest->buf, pos, nr, a[c] >> (64 - nr));
+        }
+      }
+    }
+  }
+
+  dest->len = src->len;
+  clear_tail(dest);
+}
+
+/* Reverse the order of the low `w` bits */
+static uint64_t reflect(uint64_t x, size_t w) {
+  return rev_bytes(__builtin_bswap64(x)) >> (64 - w);
+}
+
+/* `n` bits read off the stream as the value the model feeds in. Bytes are
+ * values with their first bit at the bottom under BITBUF_LSB_FIRST, so a
+ * CRC over whole bytes is the same in either bit order
+ */
+static inline uint64_t crc_in(uint64_t v, size_t n) {
+#ifdef BITBUF_LSB_FIRST
+  if (n == 64) return rev_bytes(v);
+  return n ? reflect(v, n) : 0;
+#else
+  (void)n;
+  return v;
+#endif
+}
+
+void bitbuf_crc_init(bitbuf_crc_model *crc) {
+  if (crc->width < 1 || crc->width > 64) die("crc_init: Width must be 1-64");
+
+  /* Non-reflected models keep the register at the top of a word, reflected
+   * ones at the bottom, so any width shares the same byte tables
+   */
+  uint64_t poly = crc->refin ? reflect(crc->poly, crc->width)
+                             : crc->poly << (64 - crc->width);
+  uint64_t v;
+  int i, j, k;
+  for (i = 0; i < 256; ++i) {
+    if (crc->refin) {
+      for (v = i, j = 0; j < 8; ++j) v = v & 1 ? v >> 1 ^ poly : v >> 1;
+    } else {
+      for (v = (uint64_t)i << 56, j = 0; j < 8; ++j)
+        v = v >> 63 ? v << 1 ^ poly : v << 1;
+    }
+    crc->table[0][i] = v;
+  }
+
+  /* table[k] holds the effect of a byte followed by k zero bytes */
+  for (k = 1; k < 8; ++k) {
+    for (i = 0; i < 256; ++i) {
+      v = crc->table[k - 1][i];
+      crc->table[k][i] = crc->refin ? v >> 8 ^ crc->table[0][v & 0xff]
+                                    : v << 8 ^ crc->table[0][v >> 56];
+    }
+  }
+  crc->ready = 1;
+}
+
+#ifdef BITBUF_X86
+__attribute__((target("sse4.2"))) static uint64_t crc32c_hw(
+    uint64_t r, const unsigned char *p, size_t pos, size_t n, size_t limit) {
+  for (; n >= 64; pos += 64, n -= 64)
+    r = _mm_crc32_u64(r, __builtin_bswap64(crc_in(load_bits(p, pos, 64, limit),
+                                                   64)));
+  return r;
+}
+#endif
+
+unsigned long long bitbuf_crc(const bitbuf *bb, size_t start, size_t nbits,
+                              const bitbuf_crc_model *crc) {
+  if (!crc->ready) die("crc: Model needs bitbuf_crc_init() first");
+  if (start + nbits > bb->len) die("crc: Out of bounds");
+
+  const uint64_t(*t)[256] = (const uint64_t(*)[256])crc->table;
+  const unsigned char *p = bb->buf;
+  size_t w = crc->width, pos = start, n = nbits, i;
+  uint64_t r, v, poly;
+
+  /* Bytes are taken from the stream as is, at any bit offset, with whole
+   * word loads; only the last < 8 bits go one at a time
+   */
+  if (crc->refin) {
+    r = reflect(crc->init, w);
+    poly = reflect(crc->poly, w);
+#ifdef BITBUF_X86
+    if (w == 32 && crc->poly == 0x1edc6f41 &&
+        __builtin_cpu_supports("sse4.2")) {
+      r = crc32c_hw(r, p, pos, n, bb->len);
+      pos += n / 64 * 64;
+      n %= 64;
+    }
+#endif
+    for (; n >= 64; pos += 64, n -= 64) {
+      r ^= __builtin_bswap64(crc_in(load_bits(p, pos, 64, bb->len), 64));
+      r = t[7][r & 0xff] ^ t[6][r >> 8 & 0xff] ^ t[5][r >> 16 & 0xff] ^
+          t[4][r >> 24 & 0xff] ^ t[3][r >> 32 & 0xff] ^ t[2][r >> 40 & 0xff] ^
+          t[1][r >> 48 & 0xff] ^ t[0][r >> 56];
+    }
+    for (; n >= 8; pos += 8, n -= 8)
+      r = r >> 8 ^ t[0][(r ^ crc_in(getbits(p, pos, 8), 8)) & 0xff];
+    /* A trailing partial byte is fed least significant bit first too */
+    for (v = crc_in(getbits(p, pos, n), n), i = 0; i < n; ++i, v >>= 1) {
+      r ^= v & 1;
+      r = r & 1 ? r >> 1 ^ poly : r >> 1;
+    }
+    if (!crc->refout) r = reflect(r, w);
+  } else {
+    r = crc->init << (64 - w);
+    poly = crc->poly << (64 - w);
+    for (; n >= 64; pos += 64, n -= 64) {
+      r ^= crc_in(load_bits(p, pos, 64, bb->len), 64);
+      r = t[7][r >> 56] ^ t[6][r >> 48 & 0xff] ^ t[5][r >> 40 & 0xff] ^
+          t[4][r >> 32 & 0xff] ^ t[3][r >> 24 & 0xff] ^ t[2][r >> 16 & 0xff] ^
+          t[1][r >> 8 & 0xff] ^ t[0][r & 0xff];
+    }
+    for (; n >= 8; pos += 8, n -= 8) {
+      r ^= crc_in(getbits(p, pos, 8), 8) << 56;
+      r = r << 8 ^ t[0][r >> 56];
+    }
+    for (v = crc_in(getbits(p, pos, n), n), i = n; i--;) {
+      r ^= (v >> i & 1) << 63;
+      r = r >> 63 ? r << 1 ^ poly : r << 1;
+    }
+    r >>= 64 - w;
+    if (crc->refout) r = reflect(r, w);
+  }
+
+  r ^= crc->xorout;
+  return w == 64 ? r : r & ((1ULL << w) - 1);
+}
+
+/* Hashing
+ * wyhash-style: 128-bit multiply-and-fold over 16 bytes per round. Only the
+ * bits up to `len` are hashed, the garbage past it is masked off
+ */
+static const uint64_t hash_p[3] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+                                   0x8ebc6af09c88c6e3ULL};
+
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t rd64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+uint64_t bitbuf_hash(const bitbuf *bb, uint64_t seed) {
+  const unsigned char *p = bb->buf;
+  size_t full = bb->len / 8, i, rem;
+  uint64_t h = seed ^ mum(seed ^ hash_p[0], bb->len ^ hash_p[1]);
+
+  for (i = 0; i + 16 <= full; i += 16)
+    h = mum(rd64(p + i) ^ hash_p[1], rd64(p + i + 8) ^ h);
+
+  /* Whatever is left fits in 16 bytes, partial byte included */
+  unsigned char last[16] = {0};
+  rem = full - i;
+  memcpy(last, p + i, rem);
+  if (bb->len % 8) last[rem] = p[full] & ORD(0xff << (8 - bb->len % 8));
+
+  h = mum(rd64(last) ^ hash_p[1], rd64(last + 8) ^ h);
+  return mum(h ^ hash_p[2], bb->len ^ hash_p[1]);
+}
+
+/* Buffers are equal up to their length, ignoring the garbage past it */
+static int same_bits(const bitbuf *a, const bitbuf *b) {
+  size_t full = a->len / 8, rem = a->len % 8;
+  if (a->len != b->len || memcmp(a->buf, b->buf, full)) return 0;
+  return !rem || !((a->buf[full] ^ b->buf[full]) & ORD(0xff << (8 - rem)));
+}
+
+/* Open addressing in the style of SwissTable: one control byte per slot
+ * holding 7 bits of the hash (or MAP_EMPTY), probed 16 slots at a time with
+ * a single SSE2 compare
+ */
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_CHUNK 65536
+
+static inline unsigned map_match(const unsigned char *ctrl, unsigned char c) {
+#ifdef __SSE2__
+  __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+  unsigned i, bits = 0;
+  for (i = 0; i < MAP_GROUP; ++i) bits |= (unsigned)(ctrl[i] == c) << i;
+  return bits;
+#endif
+}
+
+/* Slot holding `key`, or the empty slot where it belongs when absent */
+static size_t map_find(const bitbuf_map *m, const bitbuf *key, uint64_t h,
+                       int *found) {
+  size_t mask = m->cap / MAP_GROUP - 1;
+  size_t g = (h >> 7) & mask;
+  unsigned char tag = h & 0x7f;
+  unsigned bits;
+
+  for (;; g = (g + 1) & mask) {
+    const unsigned char *ctrl = m->ctrl + g * MAP_GROUP;
+    for (bits = map_match(ctrl, tag); bits; bits &= bits - 1) {
+      size_t slot = g * MAP_GROUP + __builtin_ctz(bits);
+      if (same_bits(&m->keys[slot], key)) {
+        *found = 1;
+        return slot;
+      }
+    }
+    if ((bits = map_match(ctrl, MAP_EMPTY))) {
+      *found = 0;
+      return g * MAP_GROUP + __builtin_ctz(bits);
+    }
+  }
+}
+
+static void map_alloc(bitbuf_map *m, size_t cap) {
+  m->cap = cap;
+  m->ctrl = (unsigned char *)malloc(cap);
+  m->keys = (bitbuf *)malloc(cap * sizeof(bitbuf));
+  m->vals = (void **)malloc(cap * sizeof(void *));
+  if (!m->ctrl || !m->keys || !m->vals) die("map: Could not allocate table");
+  memset(m->ctrl, MAP_EMPTY, cap);
+}
+
+static void map_rehash(bitbuf_map *m) {
+  bitbuf_map old = *m;
+  size_t i;
+  int found;
+
+  map_alloc(m, old.cap * 2);
+  for (i = 0; i < old.cap; ++i) {
+    if (old.ctrl[i] == MAP_EMPTY) continue;
+    uint64_t h = bitbuf_hash(&old.keys[i], m->seed);
+    size_t slot = map_find(m, &old.keys[i], h, &found);
+    m->ctrl[slot] = h & 0x7f;
+    m->keys[slot] = old.keys[i];
+    m->vals[slot] = old.vals[i];
+  }
+  free(old.ctrl);
+  free(old.keys);
+  free(old.vals);
+}
+
+/* Copy the bits of `key` into the arena and return a view of the copy */
+static bitbuf map_store(bitbuf_map *m, const bitbuf *key) {
+  size_t n = BYTE_LEN(key->len);
+  if (m->nchunks == 0 || m->used + n > m->chunk_size) {
+    m->chunk_size = n > MAP_CHUNK ? n : MAP_CHUNK;
+    m->chunks = (unsigned char **)realloc(
+        m->chunks, (m->nchunks + 1) * sizeof(unsigned char *));
+    if (m->chunks == NULL ||
+        (m->chunks[m->nchunks] = (unsigned char *)malloc(m->chunk_size)) ==
+            NULL)
+      die("map: Could not allocate key storage");
+    m->nchunks++;
+    m->used = 0;
+  }
+
+  bitbuf view = {0, key->len, m->chunks[m->nchunks - 1] + m->used};
+  if (n) memcpy(view.buf, key->buf, n);
+  clear_tail(&view);
+  m->used += n;
+  return view;
+}
+
+void bitbuf_map_init(bitbuf_map *m) {
+  memset(m, 0, sizeof(*m));
+  m->seed = hash_p[2];
+  map_alloc(m, MAP_GROUP);
+}
+
+void bitbuf_map_release(bitbuf_map *m) {
+  size_t i;
+  for (i = 0; i < m->nchunks; ++i) free(m->chunks[i]);
+  free(m->chunks);
+  free(m->ctrl);
+  free(m->keys);
+  free(m->vals);
+  memset(m, 0, sizeof(*m));
+}
+
+int bitbuf_map_put(bitbuf_map *m, const bitbuf *key, void *val) {
+  uint64_t h = bitbuf_hash(key, m->seed);
+  int found;
+  size_t slot = map_find(m, key, h, &found);
+  if (found) {
+    m->vals[slot] = val;
+    return 0;
+  }
+
+  /* Keep the table at most 7/8 full so probes always hit an empty slot */
+  if ((m->count + 1) * 8 > m->cap * 7) {
+    map_rehash(m);
+    slot = map_find(m, key, h, &found);
+  }
+  m->ctrl[slot] = h & 0x7f;
+  m->keys[slot] = map_store(m, key);
+  m->vals[slot] = val;
+  m->count++;
+  return 1;
+}
+
+void **bitbuf_map_get(const bitbuf_map *m, const bitbuf *key) {
+  int found;
+  size_t slot = map_find(m, key, bitbuf_hash(key, m->seed), &found);
+  return found ? &m->vals[slot] : NULL;
+}
+
+/* Correlation
+ * Short patterns XOR and popcount a word of the pattern at a time against
+ * every offset. Long ones go through a number-theoretic transform: with bits
+ * mapped to +1 / -1 the correlation at each offset is m - 2 * distance, and
+ * the source is cut into overlapping blocks convolved with the reversed
+ * pattern (overlap-save)
+ */
+#define CORR_NTT_MIN 1024
+#define NTT_MOD 998244353u
+#define NTT_ROOT 3
+
+static uint32_t ntt_pow(uint64_t b, uint64_t e) {
+  uint64_t r = 1;
+  for (b %= NTT_MOD; e; e >>= 1, b = b * b % NTT_MOD)
+    if (e & 1) r = r * b % NTT_MOD;
+  return r;
+}
+
+static void ntt(uint32_t *a, size_t n, int inverse) {
+  size_t i, j, k, len;
+  uint32_t t;
+
+  for (i = 1, j = 0; i < n; ++i) {
+    for (k = n >> 1; j & k; k >>= 1) j ^= k;
+    j ^= k;
+    if (i < j) {
+      t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  }
+  for (len = 2; len <= n; len <<= 1) {
+    uint64_t wl = ntt_pow(NTT_ROOT, (NTT_MOD - 1) / len);
+    if (inverse) wl = ntt_pow(wl, NTT_MOD - 2);
+    for (i = 0; i < n; i += len) {
+      uint64_t w = 1;
+      for (k = 0; k < len / 2; ++k, w = w * wl % NTT_MOD) {
+        uint32_t u = a[i + k];
+        uint32_t v = w * a[i + k + len / 2] % NTT_MOD;
+        a[i + k] = u + v < NTT_MOD ? u + v : u + v - NTT_MOD;
+        a[i + k + len / 2] = u >= v ? u - v : u + NTT_MOD - v;
+      }
+    }
+  }
+  if (inverse) {
+    uint64_t ninv = ntt_pow(n, NTT_MOD - 2);
+    for (i = 0; i < n; ++i) a[i] = a[i] * ninv % NTT_MOD;
+  }
+}
+
+static void correlate_words(const bitbuf *src, const bitbuf *pat,
+                            uint16_t *out, size_t cnt) {
+  size_t m = pat->len, nw = (m + 63) / 64, i, c, k, d;
+  uint64_t pw[CORR_NTT_MIN / 64];
+  for (c = 0; c < nw; ++c) {
+    k = szmin(64, m - c * 64);
+    pw[c] = load_bits(pat->buf, c * 64, k, m);
+  }
+
+  for (i = 0; i < cnt; ++i) {
+    for (c = d = 0; c < nw; ++c) {
+      k = szmin(64, m - c * 64);
+      d += __builtin_popcountll(
+          load_bits(src->buf, i + c * 64, k, src->len) ^ pw[c]);
+    }
+    out[i] = d;
+  }
+}
+
+static void correlate_ntt(const bitbuf *src, const bitbuf *pat,
+                          uint16_t *out, size_t cnt) {
+  size_t m = pat->len, n = 1, i, t, i0;
+  while (n < 4 * m) n <<= 1;
+  size_t step = n - m + 1;
+
+  uint32_t *pb = (uint32_t *)calloc(2 * n, sizeof(uint32_t));
+  if (pb == NULL) die("correlate: Could not allocate %zu words", 2 * n);
+  uint32_t *sb = pb + n;
+
+  /* Bits map to +1 / -1; the pattern is reversed to turn the convolution
+   * into a correlation
+   */
+  for (i = 0; i < m; ++i)
+    pb[m - 1 - i] = bitbuf_getbit(pat, i) ? NTT_MOD - 1 : 1;
+  ntt(pb, n, 0);
+
+  for (i0 = 0; i0 < cnt; i0 += step) {
+    for (t = 0, i = i0; t < n; ++t, ++i)
+      sb[t] = i >= src->len ? 0
+              : src->buf[i / 8] & BIT_MASK(i) ? NTT_MOD - 1
+                                               : 1;
+    ntt(sb, n, 0);
+    for (t = 0; t < n; ++t) sb[t] = (uint64_t)sb[t] * pb[t] % NTT_MOD;
+    ntt(sb, n, 1);
+
+    /* Circular wrap only spoils the first m - 1 results of each block */
+    for (t = m - 1; t < n && i0 + t - (m - 1) < cnt; ++t) {
+      long long corr = sb[t] > NTT_MOD / 2 ? (long long)sb[t] - NTT_MOD
+                                           : (long long)sb[t];
+      out[i0 + t - (m - 1)] = (m - corr) / 2;
+    }
+  }
+  free(pb);
+}
+
+size_t bitbuf_correlate(const bitbuf *src, const bitbuf *pat, uint16_t *out) {
+  size_t m = pat->len;
+  if (m > UINT16_MAX) die("correlate: Pattern longer than %d bits", UINT16_MAX);
+  if (!m || m > src->len) return 0;
+
+  STAT_BEGIN();
+  size_t cnt = src->len - m + 1;
+  if (m < CORR_NTT_MIN)
+    correlate_words(src, pat, out, cnt);
+  else
+    correlate_ntt(src, pat, out, cnt);
+  STAT_END(BITBUF_STAT_FIND, BYTE_LEN(src->len));
+  return cnt;
+}
+
+/* Batches
+ * While one buffer is worked on, the contents of the one BATCH_AHEAD entries
+ * on are prefetched, and the struct twice as far, so its `buf` is at hand
+ * by the time it is needed
+ */
+#define BATCH_AHEAD 8
+
+static inline void batch_prefetch(const bitbuf *bbs, size_t i, size_t n) {
+  if (i + 2 * BATCH_AHEAD < n) __builtin_prefetch(&bbs[i + 2 * BATCH_AHEAD]);
+  if (i + BATCH_AHEAD < n) __builtin_prefetch(bbs[i + BATCH_AHEAD].buf);
+}
+
+void bitbuf_find_batch(const bitbuf *srcs, size_t n, const bitbuf *pat,
+                       size_t garble, int *results) {
+  size_t i;
+  bitbuf_pattern *cp = NULL;
+  if (!garble && pat->len > FIND_SHORT) cp = bitbuf_pattern_compile(pat);
+
+  for (i = 0; i < n; ++i) {
+    batch_prefetch(srcs, i, n);
+    results[i] = cp ? bitbuf_find_compiled(&srcs[i], cp, 0)
+                    : bitbuf_find(&srcs[i], pat, garble, 0);
+  }
+  if (cp) bitbuf_pattern_free(cp);
+}
+
+void bitbuf_weight_batch(const bitbuf *bbs, size_t n, size_t *out) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    batch_prefetch(bbs, i, n);
+    out[i] = weight_bytes(bbs[i].buf, BYTE_LEN(bbs[i].len));
+  }
+}
+
+void bitbuf_hash_batch(const bitbuf *bbs, size_t n, uint64_t seed,
+                       uint64_t *out) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    batch_prefetch(bbs, i, n);
+    out[i] = bitbuf_hash(&bbs[i], seed);
+  }
+}
+
+/* Expressions
+ * Nodes are added after their operands, so evaluating them in id order
+ * never needs a value that is not there yet. Each block gives every live
+ * node EXPR_BLOCK bytes of stack; leaves are read in place when the block
+ * is whole, and the root of bitbuf_expr_eval() writes straight into the
+ * result
+ */
+#define EXPR_BLOCK 512
+
+enum { EXPR_LEAF, EXPR_AND, EXPR_OR, EXPR_XOR, EXPR_ANDNOT, EXPR_NOT };
+
+void bitbuf_expr_init(bitbuf_expr *e) {
+  e->n = 0;
+  e->len = 0;
+}
+
+static int expr_add(bitbuf_expr *e, int op, int a, int b) {
+  if (e->n == BITBUF_EXPR_MAX)
+    die("expr: More than %d nodes in an expression", BITBUF_EXPR_MAX);
+  if (a < 0 || (size_t)a >= e->n || b < 0 || (size_t)b >= e->n)
+    die("expr: Unknown node");
+
+  e->node[e->n].op = op;
+  e->node[e->n].a = a;
+  e->node[e->n].b = b;
+  e->node[e->n].leaf = NULL;
+  return e->n++;
+}
+
+int bitbuf_expr_leaf(bitbuf_expr *e, const bitbuf *bb) {
+  size_t i;
+  for (i = 0; i < e->n; ++i)
+    if (e->node[i].op == EXPR_LEAF && e->node[i].leaf == bb) return i;
+
+  if (e->n == BITBUF_EXPR_MAX)
+    die("expr: More than %d nodes in an expression", BITBUF_EXPR_MAX);
+  if (e->n && bb->len != e->len)
+    die("expr: Buffers should be of same length");
+
+  e->len = bb->len;
+  e->node[e->n].op = EXPR_LEAF;
+  e->node[e->n].a = e->node[e->n].b = 0;
+  e->node[e->n].leaf = bb;
+  return e->n++;
+}
+
+int bitbuf_expr_and(bitbuf_expr *e, int a, int b) {
+  return expr_add(e, EXPR_AND, a, b);
+}
+int bitbuf_expr_or(bitbuf_expr *e, int a, int b) {
+  return expr_add(e, EXPR_OR, a, b);
+}
+int bitbuf_expr_xor(bitbuf_expr *e, int a, int b) {
+  return expr_add(e, EXPR_XOR, a, b);
+}
+int bitbuf_expr_andnot(bitbuf_expr *e, int a, int b) {
+  return expr_add(e, EXPR_ANDNOT, a, b);
+}
+int bitbuf_expr_not(bitbuf_expr *e, int a) {
+  return expr_add(e, EXPR_NOT, a, a);
+}
+
+static void expr_apply(int op, unsigned char *d, const unsigned char *a,
+                       const unsigned char *b, size_t nw) {
+  size_t i;
+  uint64_t x, y;
+
+#define EXPR_LOOP(f)                 \
+  for (i = 0; i < nw * 8; i += 8) { \
+    x = rd64(a + i);                \
+    y = rd64(b + i);                \
+    x = f;                          \
+    memcpy(d + i, &x, 8);           \
+  }
+
+  switch (op) {
+    case EXPR_AND:
+      EXPR_LOOP(x & y);
+      break;
+    case EXPR_OR:
+      EXPR_LOOP(x | y);
+      break;
+    case EXPR_XOR:
+      EXPR_LOOP(x ^ y);
+      break;
+    case EXPR_ANDNOT:
+      EXPR_LOOP(x & ~y);
+      break;
+    case EXPR_NOT:
+      EXPR_LOOP(~x);
+      break;
+  }
+#undef EXPR_LOOP
+}
+
+struct expr_ctx {
+  const bitbuf_expr *e;
+  int root;
+  unsigned char live[BITBUF_EXPR_MAX];
+  unsigned char *out; /* NULL when only counting */
+  size_t nbytes;
+  size_t cnt;
+};
+
+/* Evaluate the `nbytes` <= EXPR_BLOCK bytes at `off`, returning the root */
+static const unsigned char *expr_block(struct expr_ctx *c, size_t off,
+                                       size_t nbytes,
+                                       uint64_t reg[][EXPR_BLOCK / 8]) {
+  const unsigned char *val[BITBUF_EXPR_MAX];
+  size_t nw = (nbytes + 7) / 8;
+  int k;
+
+  for (k = 0; k <= c->root; ++k) {
+    if (!c->live[k]) continue;
+    unsigned char *d = (unsigned char *)reg[k];
+    int op = c->e->node[k].op;
+
+    if (op == EXPR_LEAF) {
+      val[k] = c->e->node[k].leaf->buf + off;
+      if (nbytes < EXPR_BLOCK) {
+        /* Word loads would run past the end of the leaf */
+        memcpy(d, val[k], nbytes);
+        memset(d + nbytes, 0, nw * 8 - nbytes);
+        val[k] = d;
+      }
+      continue;
+    }
+    if (k == c->root && c->out && nbytes == EXPR_BLOCK) d = c->out + off;
+    expr_apply(op, d, val[c->e->node[k].a], val[c->e->node[k].b], nw);
+    val[k] = d;
+  }
+  return val[c->root];
+}
+
+static void expr_range(size_t lo, size_t hi, void *ctx) {
+  struct expr_ctx *c = (struct expr_ctx *)ctx;
+  uint64_t reg[BITBUF_EXPR_MAX][EXPR_BLOCK / 8];
+  size_t off, cnt = 0, len = c->e->len;
+
+  for (off = lo; off < hi; off += EXPR_BLOCK) {
+    size_t nbytes = szmin(EXPR_BLOCK, hi - off);
+    const unsigned char *r = expr_block(c, off, nbytes, reg);
+
+    if (c->out) {
+      if (r != c->out + off) memcpy(c->out + off, r, nbytes);
+    } else if (off + nbytes == c->nbytes && len % 8) {
+      cnt += weight_bytes(r, nbytes - 1);
+      cnt += popcnt(r[nbytes - 1] & ORD(0xff << (8 - len % 8)));
+    } else {
+      cnt += weight_bytes(r, nbytes);
+    }
+  }
+  if (!c->out) __atomic_fetch_add(&c->cnt, cnt, __ATOMIC_RELAXED);
+}
+
+static void expr_run(struct expr_ctx *c) {
+  const bitbuf_expr *e = c->e;
+  size_t k, leaves = 0;
+
+  if (c->root < 0 || (size_t)c->root >= e->n) die("expr: Unknown node");
+
+  memset(c->live, 0, sizeof(c->live));
+  c->live[c->root] = 1;
+  for (k = c->root + 1; k-- > 0;) {
+    if (!c->live[k]) continue;
+    if (e->node[k].op == EXPR_LEAF) {
+      leaves++;
+    } else {
+      c->live[e->node[k].a] = 1;
+      c->live[e->node[k].b] = 1;
+    }
+  }
+
+  c->nbytes = BYTE_LEN(e->len);
+  c->cnt = 0;
+  size_t n = c->nbytes, bytes = n * (leaves + (c->out != NULL));
+  par_run(n, par_chunk(n, EXPR_BLOCK, bytes), expr_range, c);
+}
+
+void bitbuf_expr_eval(const bitbuf_expr *e, int root, bitbuf *res) {
+  STAT_BEGIN();
+  if (res->alloc <= e->len) bitbuf_grow(res, e->len - res->alloc + 8);
+
+  struct expr_ctx c = {e, root, {0}, res->buf, 0, 0};
+  expr_run(&c);
+
+  res->len = e->len;
+  clear_tail(res);
+  STAT_END(BITBUF_STAT_OP, c.nbytes);
+}
+
+size_t bitbuf_expr_weight(const bitbuf_expr *e, int root) {
+  STAT_BEGIN();
+  struct expr_ctx c = {e, root, {0}, NULL, 0, 0};
+  expr_run(&c);
+
+  STAT_END(BITBUF_STAT_WEIGHT, c.nbytes);
+  return c.cnt;
+}
+
 void bitbuf_addstr(bitbuf *bb, const char *str, size_t base, size_t ulen) {
   /* Maximum length of string that can be converted at a time
    * considering the size limitation of unsigned long int */
@@ -513,29 +2940,29 @@ void bitbuf_addstr_bin(bitbuf *bb, const char *str) {
 }
 
 void bitbuf_insert(bitbuf *dest, const bitbuf *src, size_t idx) {
-  bitbuf tail = BITBUF_INIT;
-  bitbuf_slice(&tail, dest, idx, dest->len - idx);
-  bitbuf_setlen(dest, idx);
-
-  // Clear out dirty bits in the byte where new bits
-  // will be inserted
-  unsigned char *trash = &(dest->buf[idx / 8]);
-  int clr = 8 - (idx % 8);
-  *trash = *trash >> clr << clr;
-
-  bitbuf_addbuf(dest, src);
-  bitbuf_addbuf(dest, &tail);
-  bitbuf_release(&tail);
+  if (idx > dest->len) die("insert: Out of bounds");
+  STAT_BEGIN();
+
+  size_t n = src->len;
+  size_t tail = dest->len - idx;
+  if (n > bitbuf_avail(dest)) bitbuf_grow(dest, n + dest->len);
+
+  /* Open a gap and fill it in place */
+  copy_bits(dest->buf, idx + n, dest->buf, idx, tail);
+  if (src == dest) {
+    /* The second half of `src` just moved past the gap */
+    copy_bits(dest->buf, idx, dest->buf, 0, idx);
+    copy_bits(dest->buf, idx * 2, dest->buf, idx + n, tail);
+  } else {
+    copy_bits(dest->buf, idx, src->buf, 0, n);
+  }
+  dest->len += n;
+  clear_tail(dest);
+  STAT_END(BITBUF_STAT_INSERT, BYTE_LEN(tail + n));
 }
 
 void bitbuf_prependbuf(bitbuf *dest, bitbuf *src) {
-  unsigned char destHead = dest->buf[0] >> (src->len % 8);
-
-  bitbuf_setlen(dest, dest->len + src->len);
-  bitbuf_rsh(dest, src->len);
-
-  memcpy(dest->buf, src->buf, BYTE_LEN(src->len));
-  dest->buf[src->len / 8] |= destHead;
+  bitbuf_insert(dest, src, 0);
 }
 
 char *bitbuf_rep(bitbuf *bb) {
@@ -575,6 +3002,7 @@ void bitbuf_dump(bitbuf *bb) {
 }
 
 size_t bitbuf_read(bitbuf *bb, FILE *fp) {
+  STAT_BEGIN();
   bitbuf_reset(bb);
   fseek(fp, 0, SEEK_END);
   size_t fsize = ftell(fp);
@@ -587,34 +3015,402 @@ size_t bitbuf_read(bitbuf *bb, FILE *fp) {
     die("read: Could not read from file");
 
   bb->len = bitlen;
+  STAT_END(BITBUF_STAT_READ, fsize);
   return bitlen;
 }
 
 size_t bitbuf_write(bitbuf *bb, FILE *fp) {
-  return bb->len ? fwrite(bb->buf, 1, BYTE_LEN(bb->len), fp) : 0;
+  STAT_BEGIN();
+  size_t n = bb->len ? fwrite(bb->buf, 1, BYTE_LEN(bb->len), fp) : 0;
+  STAT_END(BITBUF_STAT_WRITE, n);
+  return n;
 }
 
-void bitbuf_bin(const bitbuf *bb, char *str) {
+/* Fills `block` with up to `n` bytes from the stream and returns the number
+ * of bytes read, 0 meaning end of stream
+ */
+typedef size_t (*ReadPtr)(void *src, unsigned char *block, size_t n);
+
+static size_t read_file(void *src, unsigned char *block, size_t n) {
+  FILE *fp = (FILE *)src;
+  size_t got = fread(block, 1, n, fp);
+  if (got == 0 && ferror(fp)) die("find_stream: Could not read from file");
+  return got;
+}
+
+static size_t read_fd(void *src, unsigned char *block, size_t n) {
+  ssize_t got;
+  while ((got = read(*(int *)src, block, n)) < 0)
+    if (errno != EINTR) die("find_fd: %s", strerror(errno));
+  return got;
+}
+
+static size_t find_stream(ReadPtr rd, void *src, const bitbuf *pat,
+                          size_t garble, MatchPtr cb, void *ctx) {
+  if (pat->len == 0) die("find_stream: Cannot search for an empty pattern");
+
+  unsigned char block[MAX_BUF];
+  size_t keep = pat->len - 1;
+  size_t base, cnt, got;
+  int hit;
+  base = cnt = 0;
+
+  bitbuf win = BITBUF_INIT;
+  bitbuf_init(&win, keep + MAX_BUF * 8);
+
+  while ((got = rd(src, block, MAX_BUF)) > 0) {
+    bitbuf fresh = {0, got * 8, block};
+    bitbuf_addbuf(&win, &fresh);
+
+    /* A match starting in the carried bits is always incomplete, so
+     * nothing is reported twice
+     */
+    hit = 0;
+    while ((hit = bitbuf_find(&win, pat, garble, hit)) != -1) {
+      cb(base + hit, ctx);
+      ++cnt;
+      ++hit;
+    }
+
+    if (win.len > keep) {
+      base += win.len - keep;
+      bitbuf_lsh(&win, win.len - keep);
+      bitbuf_setlen(&win, keep);
+    }
+  }
+
+  bitbuf_release(&win);
+  return cnt;
+}
+
+size_t bitbuf_find_stream(FILE *fp, const bitbuf *pat, size_t garble,
+                          MatchPtr cb, void *ctx) {
+  return find_stream(read_file, fp, pat, garble, cb, ctx);
+}
+
+size_t bitbuf_find_fd(int fd, const bitbuf *pat, size_t garble, MatchPtr cb,
+                      void *ctx) {
+  return find_stream(read_fd, &fd, pat, garble, cb, ctx);
+}
+
+enum { SLOT_FREE, SLOT_READY, SLOT_BUSY };
+
+struct _bitbuf_ingest {
+  int fd;
+  size_t block, depth;
+  unsigned char *ring;
+  int *state;
+  size_t *fill;  /* bytes held by each slot */
+  size_t head;   /* next slot the reader fills */
+  size_t tail;   /* next slot handed to the caller */
+  size_t pos;    /* stream offset of `tail` in bits */
+  int eof, err;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, freed;
+  pthread_t reader;
+};
+
+static void ingest_unlock(void *p) {
+  pthread_mutex_unlock((pthread_mutex_t *)p);
+}
+
+/* Block until the slot under `head` is handed back. The cleanup handler
+ * releases the lock if the reader is cancelled while waiting
+ */
+static size_t ingest_wait(bitbuf_ingest *ing) {
+  size_t slot;
+  pthread_mutex_lock(&ing->lock);
+  pthread_cleanup_push(ingest_unlock, &ing->lock);
+  while (ing->state[ing->head] != SLOT_FREE)
+    pthread_cond_wait(&ing->freed, &ing->lock);
+  slot = ing->head;
+  pthread_cleanup_pop(1);
+  return slot;
+}
+
+static void *ingest_run(void *p) {
+  bitbuf_ingest *ing = (bitbuf_ingest *)p;
+  size_t slot, got;
+  ssize_t n = 0;
+  int err;
+
+  for (;;) {
+    /* Fill the slot outside of the lock; a pipe may return short reads */
+    slot = ingest_wait(ing);
+    unsigned char *dst = ing->ring + slot * ing->block;
+    for (got = 0, err = 0; got < ing->block; got += n) {
+      n = read(ing->fd, dst + got, ing->block - got);
+      if (n == 0) break;
+      if (n < 0 && (err = errno) != EINTR) break;
+      if (n < 0) n = 0;
+    }
+
+    pthread_mutex_lock(&ing->lock);
+    if (n < 0) ing->err = err;
+    ing->fill[slot] = got;
+    if (got) {
+      ing->state[slot] = SLOT_READY;
+      ing->head = (slot + 1) % ing->depth;
+    }
+    if (got < ing->block) ing->eof = 1;
+    pthread_cond_broadcast(&ing->ready);
+    pthread_mutex_unlock(&ing->lock);
+
+    if (got < ing->block) return NULL;
+  }
+}
+
+bitbuf_ingest *bitbuf_ingest_open(int fd, size_t block, size_t depth) {
+  if (block == 0 || depth < 2)
+    die("ingest_open: Need a non-empty block and at least two slots");
+
+  bitbuf_ingest *ing = (bitbuf_ingest *)calloc(1, sizeof(bitbuf_ingest));
+  if (ing == NULL) die("ingest_open: Could not allocate ring");
+  ing->fd = fd;
+  ing->block = block;
+  ing->depth = depth;
+  ing->ring = (unsigned char *)malloc(block * depth);
+  ing->state = (int *)calloc(depth, sizeof(int));
+  ing->fill = (size_t *)calloc(depth, sizeof(size_t));
+  if (!ing->ring || !ing->state || !ing->fill)
+    die("ingest_open: Could not allocate ring");
+
+  pthread_mutex_init(&ing->lock, NULL);
+  pthread_cond_init(&ing->ready, NULL);
+  pthread_cond_init(&ing->freed, NULL);
+  if (pthread_create(&ing->reader, NULL, ingest_run, ing) != 0)
+    die("ingest_open: Could not start reader thread");
+  return ing;
+}
+
+int bitbuf_ingest_next(bitbuf_ingest *ing, bitbuf *view, size_t *pos) {
+  pthread_mutex_lock(&ing->lock);
+  size_t slot = ing->tail;
+  while (ing->state[slot] != SLOT_READY && !(ing->eof && slot == ing->head))
+    pthread_cond_wait(&ing->ready, &ing->lock);
+
+  if (ing->err) die("ingest_next: %s", strerror(ing->err));
+  if (ing->state[slot] != SLOT_READY) {
+    pthread_mutex_unlock(&ing->lock);
+    return 0;
+  }
+
+  ing->state[slot] = SLOT_BUSY;
+  ing->tail = (slot + 1) % ing->depth;
+  view->buf = ing->ring + slot * ing->block;
+  view->len = ing->fill[slot] * 8;
+  view->alloc = 0;
+  if (pos) *pos = ing->pos;
+  ing->pos += view->len;
+  pthread_mutex_unlock(&ing->lock);
+  return 1;
+}
+
+void bitbuf_ingest_done(bitbuf_ingest *ing, bitbuf *view) {
+  if (view->buf < ing->ring || view->buf >= ing->ring + ing->block * ing->depth)
+    die("ingest_done: View does not belong to this ring");
+  size_t slot = (view->buf - ing->ring) / ing->block;
+
+  pthread_mutex_lock(&ing->lock);
+  ing->state[slot] = SLOT_FREE;
+  pthread_cond_signal(&ing->freed);
+  pthread_mutex_unlock(&ing->lock);
+  bitbuf_init(view, 0);
+}
+
+void bitbuf_ingest_close(bitbuf_ingest *ing) {
+  /* The reader may be blocked on a live pipe; cancel rather than wait */
+  pthread_cancel(ing->reader);
+  pthread_join(ing->reader, NULL);
+
+  pthread_mutex_destroy(&ing->lock);
+  pthread_cond_destroy(&ing->ready);
+  pthread_cond_destroy(&ing->freed);
+  free(ing->ring);
+  free(ing->state);
+  free(ing->fill);
+  free(ing);
+}
+
+/* Archive layout, all integers little-endian 64 bit
+ *   header   magic[8] | record count | index offset | reserved
+ *   records  data of each record, padded to 8 bytes
+ *   index    (offset, bit length) of each record
+ */
+static const char archive_magic[8] = {'B', 'I', 'T', 'B', 'U', 'F', 'A', '1'};
+#define ARCHIVE_HDR 32
+#define ARCHIVE_BATCH 256
+
+struct _bitbuf_archive {
+  unsigned char *map;
+  size_t size;
+  size_t count;
+  const unsigned char *index;
+};
+
+static void put_le64(unsigned char *p, unsigned long long v) {
+  int i;
+  for (i = 0; i < 8; ++i) p[i] = v >> (8 * i);
+}
+
+static unsigned long long get_le64(const unsigned char *p) {
+  unsigned long long v = 0;
+  int i;
+  for (i = 7; i >= 0; --i) v = v << 8 | p[i];
+  return v;
+}
+
+static void writev_all(int fd, struct iovec *iov, int cnt) {
+  ssize_t n;
+  while (cnt) {
+    if ((n = writev(fd, iov, cnt)) < 0) {
+      if (errno == EINTR) continue;
+      die("archive_write: %s", strerror(errno));
+    }
+    /* Skip what was written, resuming mid-vector on a short write */
+    for (; cnt && (size_t)n >= iov->iov_len; ++iov, --cnt) n -= iov->iov_len;
+    if (cnt) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+size_t bitbuf_archive_write(int fd, const bitbuf *bbs, size_t n) {
+  static const unsigned char zeros[8];
+  struct iovec iov[ARCHIVE_BATCH * 3];
+  unsigned char tails[ARCHIVE_BATCH];
+  unsigned char hdr[ARCHIVE_HDR] = {0};
+  size_t i, j, cnt, off, full;
+
+  unsigned char *index = (unsigned char *)malloc(n * 16 + 1);
+  if (index == NULL) die("archive_write: Could not allocate index");
+
+  off = ARCHIVE_HDR;
+  for (i = 0; i < n; ++i) {
+    put_le64(index + i * 16, off);
+    put_le64(index + i * 16 + 8, bbs[i].len);
+    off += (BYTE_LEN(bbs[i].len) + 7) / 8 * 8;
+  }
+
+  memcpy(hdr, archive_magic, 8);
+  put_le64(hdr + 8, n);
+  put_le64(hdr + 16, off);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = ARCHIVE_HDR;
+  writev_all(fd, iov, 1);
+
+  for (i = 0; i < n; i += ARCHIVE_BATCH) {
+    cnt = 0;
+    for (j = 0; j < ARCHIVE_BATCH && i + j < n; ++j) {
+      const bitbuf *bb = &bbs[i + j];
+      size_t rem = bb->len % 8;
+      full = bb->len / 8;
+
+      if (full) {
+        iov[cnt].iov_base = bb->buf;
+        iov[cnt++].iov_len = full;
+      }
+      /* Never persist the garbage bits past `len` */
+      if (rem) {
+        tails[j] = bb->buf[full] & ORD(0xff << (8 - rem));
+        iov[cnt].iov_base = &tails[j];
+        iov[cnt++].iov_len = 1;
+      }
+      if (BYTE_LEN(bb->len) % 8) {
+        iov[cnt].iov_base = (void *)zeros;
+        iov[cnt++].iov_len = 8 - BYTE_LEN(bb->len) % 8;
+      }
+    }
+    if (cnt) writev_all(fd, iov, cnt);
+  }
+
+  iov[0].iov_base = index;
+  iov[0].iov_len = n * 16;
+  writev_all(fd, iov, 1);
+  free(index);
+  return off + n * 16;
+}
+
+bitbuf_archive *bitbuf_archive_open(const char *fname) {
+  struct stat st;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) die("archive_open: %s does not exist", fname);
+  if (fstat(fd, &st) != 0) die("archive_open: %s", strerror(errno));
+  if ((size_t)st.st_size < ARCHIVE_HDR)
+    die("archive_open: %s is not an archive", fname);
+
+  bitbuf_archive *ar = (bitbuf_archive *)malloc(sizeof(bitbuf_archive));
+  if (ar == NULL) die("archive_open: Could not allocate archive");
+  ar->size = st.st_size;
+  ar->map = (unsigned char *)mmap(NULL, ar->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ar->map == MAP_FAILED) die("archive_open: %s", strerror(errno));
+
+  size_t idx = get_le64(ar->map + 16);
+  ar->count = get_le64(ar->map + 8);
+  if (memcmp(ar->map, archive_magic, 8) != 0 || idx > ar->size ||
+      ar->count > (ar->size - idx) / 16)
+    die("archive_open: %s is not an archive", fname);
+  ar->index = ar->map + idx;
+  return ar;
+}
+
+size_t bitbuf_archive_count(const bitbuf_archive *ar) { return ar->count; }
+
+void bitbuf_archive_get(const bitbuf_archive *ar, size_t i, bitbuf *view) {
+  if (i >= ar->count) die("archive_get: Out of bounds");
+
+  size_t off = get_le64(ar->index + i * 16);
+  size_t len = get_le64(ar->index + i * 16 + 8);
+  if (off > ar->size || BYTE_LEN(len) > ar->size - off)
+    die("archive_get: Record %zu is corrupt", i);
+
+  view->buf = ar->map + off;
+  view->len = len;
+  view->alloc = 0;
+}
+
+void bitbuf_archive_close(bitbuf_archive *ar) {
+  munmap(ar->map, ar->size);
+  free(ar);
+}
+
+struct conv_ctx {
+  const unsigned char *p;
+  char *str;
+};
+
+static void bin_range(size_t lo, size_t hi, void *ctx) {
+  struct conv_ctx *c = (struct conv_ctx *)ctx;
   size_t i;
-  unsigned char cur;
+  for (i = lo; i < hi; ++i) c->str[i] = '0' + !!(c->p[i / 8] & BIT_MASK(i));
+}
 
-  for (i = 0; i < bb->len; ++i) {
-    cur = bitbuf_getbit(bb, i);
-    if (cur)
-      str[i] = '1';
-    else
-      str[i] = '0';
+static void hex_range(size_t lo, size_t hi, void *ctx) {
+  static const char digits[] = "0123456789abcdef";
+  struct conv_ctx *c = (struct conv_ctx *)ctx;
+  size_t i;
+  for (i = lo; i < hi; ++i) {
+    unsigned char b = ORD(c->p[i]);
+    c->str[i * 2] = digits[b >> 4];
+    c->str[i * 2 + 1] = digits[b & 0xf];
   }
-  str[i] = '\0';
+}
+
+void bitbuf_bin(const bitbuf *bb, char *str) {
+  struct conv_ctx c = {bb->buf, str};
+  par_run(bb->len, par_chunk(bb->len, 64, BYTE_LEN(bb->len)), bin_range, &c);
+  str[bb->len] = '\0';
 }
 
 void bitbuf_hex(const bitbuf *bb, char *str) {
   if (bb->len % 4 != 0)
     die("hex: Cannot convert to hex unambiguously - not multiple of nibbles");
 
-  size_t i;
-  for (i = 0; i < BYTE_LEN(bb->len); ++i)
-    sprintf(str + i * 2, "%02x", bb->buf[i]);
+  size_t n = BYTE_LEN(bb->len);
+  struct conv_ctx c = {bb->buf, str};
+  par_run(n, par_chunk(n, 64, n), hex_range, &c);
 
   size_t rem = bb->len;
   if (bb->len % 4) rem = bb->len + (4 - bb->len % 4);
@@ -634,12 +3430,64 @@ BIG_UNUM bitbuf_num(const bitbuf *bb) {
   size_t i;
   for (i = 0; i < BYTE_LEN(bb->len) - 1; ++i) {
     num <<= 8;
-    num += bb->buf[i];
+    num += ORD(bb->buf[i]);
   }
 
   /* Handle remaining bits */
   size_t rem = bb->len % 8 ? bb->len % 8 : 8;
   num <<= rem;
-  num += bb->buf[i] >> (8 - rem);
+  num += ORD(bb->buf[i]) >> (8 - rem);
   return num;
 }
+
+static const char *stat_names[BITBUF_STAT_NFN] = {
+    "grow", "slice",  "addbuf",  "insert", "lsh",  "rsh",  "find",
+    "replace", "op", "weight", "reverse", "read", "write"};
+
+const char *bitbuf_stats_name(int fn) {
+  if (fn < 0 || fn >= BITBUF_STAT_NFN) die("stats: Unknown function %d", fn);
+  return stat_names[fn];
+}
+
+void bitbuf_stats_snapshot(bitbuf_stats *out) {
+  memset(out, 0, sizeof(*out));
+#ifdef BITBUF_STATS
+  struct stat_slot sum, *cur;
+  memset(&sum, 0, sizeof(sum));
+
+  pthread_mutex_lock(&stat_lock);
+  stat_merge(&sum, &stat_retired);
+  for (cur = stat_slots; cur; cur = cur->next) stat_merge(&sum, cur);
+
+  int i;
+  for (i = 0; i < BITBUF_STAT_NFN; ++i) {
+    out->fn[i].calls = sum.fn[i].calls - stat_base.fn[i].calls;
+    out->fn[i].bytes = sum.fn[i].bytes - stat_base.fn[i].bytes;
+    out->fn[i].cycles = sum.fn[i].cycles - stat_base.fn[i].cycles;
+  }
+  out->reallocs = sum.reallocs - stat_base.reallocs;
+  out->realloc_bytes = sum.realloc_bytes - stat_base.realloc_bytes;
+  pthread_mutex_unlock(&stat_lock);
+
+  out->alloc_bits = __atomic_load_n(&stat_alloc_bits, __ATOMIC_RELAXED);
+  out->peak_bits = __atomic_load_n(&stat_peak_bits, __ATOMIC_RELAXED);
+#endif
+}
+
+void bitbuf_stats_reset(void) {
+#ifdef BITBUF_STATS
+  /* Counters are never cleared in place since their owners write them
+   * without locking; remember the current totals as the new zero instead
+   */
+  struct stat_slot *cur;
+  pthread_mutex_lock(&stat_lock);
+  memset(&stat_base, 0, sizeof(stat_base));
+  stat_merge(&stat_base, &stat_retired);
+  for (cur = stat_slots; cur; cur = cur->next) stat_merge(&stat_base, cur);
+  pthread_mutex_unlock(&stat_lock);
+
+  __atomic_store_n(&stat_peak_bits,
+                   __atomic_load_n(&stat_alloc_bits, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+#endif
+}
@@ -1,9 +1,14 @@
 #ifndef _BITBUF_H
 #define _BITBUF_H
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct _bitbuf {
   size_t alloc;
   size_t len;
@@ -19,6 +24,16 @@ extern unsigned char bitbuf_slopbuf[];
 #define BITBUF_INIT \
   { 0, 0, bitbuf_slopbuf }
 
+/* Bit order
+ * The first bit of the stream is the most significant bit of its byte.
+ * Define BITBUF_LSB_FIRST when building the library, and everything that
+ * includes this header, to make it the least significant one instead, as
+ * USB, CAN and most radio PHYs send it. Bytes (addbyte, getbyte, ascii,
+ * read / write, CRCs) are taken as they sit in memory, while digit strings
+ * (addstr, init_str, bin, hex) and bitbuf_num() spell out the stream, first
+ * bit on the left / on top
+ */
+
 /* Least number of bytes required to fill `n` bits */
 #define BYTE_LEN(n) (n + 7) / 8
 
@@ -93,11 +108,18 @@ unsigned char *bitbuf_detach(bitbuf *, size_t *);
 /* Copy contents of the buffer */
 void bitbuf_copy(bitbuf *dest, const bitbuf *src);
 
+/* Copy `n` bits of `src` starting at `spos` over the bits of `dest` starting
+ * at `dpos`. Works like memmove(); both may be the same buffer and the ranges
+ * may overlap. `dest` is grown and lengthened if the copy runs past its end
+ */
+void bitbuf_copy_bits(bitbuf *dest, size_t dpos, const bitbuf *src,
+                      size_t spos, size_t n);
+
 /* Swap the contents */
 static inline void bitbuf_swap(bitbuf *a, bitbuf *b) {
-  bitbuf *tmp = a;
+  bitbuf tmp = *a;
   *a = *b;
-  *b = *tmp;
+  *b = tmp;
 }
 
 /* Determine the amount of allocated but unused memory */
@@ -132,11 +154,37 @@ void bitbuf_setlen(bitbuf *bb, size_t len);
 size_t bitbuf_weight(const bitbuf *);
 
 /* Find a pattern within the src buffer and return the matching index
+ * Up to `garble` bits of the match may differ from the pattern
  * If no patterns are found, return -1
  */
 int bitbuf_find(const bitbuf *src, const bitbuf *pat, size_t garble,
                 size_t offset);
 
+/* Find the first approximate match of `pat` allowing up to `max_edits` bit
+ * substitutions, insertions and deletions. Returns the position just past
+ * the end of the match, extended while its distance keeps dropping, and
+ * stores that distance in `dist`. If no patterns are found, return -1
+ */
+int bitbuf_find_edit(const bitbuf *src, const bitbuf *pat, size_t max_edits,
+                     size_t offset, size_t *dist);
+
+/* Hamming distance between `pat` and the source at every offset, written to
+ * `out`. Returns the number of offsets, `src->len - pat->len + 1`
+ */
+size_t bitbuf_correlate(const bitbuf *src, const bitbuf *pat, uint16_t *out);
+
+/* A pattern prepared once for exact searches in many buffers. Patterns of
+ * 16 bits or more skip ahead over source bytes that cannot start a match
+ */
+typedef struct _bitbuf_pattern bitbuf_pattern;
+
+bitbuf_pattern *bitbuf_pattern_compile(const bitbuf *pat);
+void bitbuf_pattern_free(bitbuf_pattern *);
+
+/* bitbuf_find() with no garbling allowed, using a compiled pattern */
+int bitbuf_find_compiled(const bitbuf *src, const bitbuf_pattern *,
+                         size_t offset);
+
 /* Replace the first occurence of `old` with `fresh`
  * Returns the number of patterns replaced
  */
@@ -150,6 +198,28 @@ int bitbuf_replace(bitbuf *src, const bitbuf *old, const bitbuf *fresh,
  */
 int bitbuf_cmp(const bitbuf *, const bitbuf *);
 
+/* Same as bitbuf_cmp() over `n` bits of each buffer starting at the given
+ * offsets, which need not be byte aligned
+ */
+int bitbuf_cmp_range(const bitbuf *a, size_t astart, const bitbuf *b,
+                     size_t bstart, size_t n);
+
+/* Total order over buffers of any length: bitwise lexicographic, with a
+ * buffer sorting before every longer buffer it is a prefix of
+ */
+int bitbuf_cmp_lex(const bitbuf *, const bitbuf *);
+
+/* Index of the first bit where the buffers differ. Returns the length of the
+ * shorter buffer if one is a prefix of the other
+ */
+size_t bitbuf_first_diff(const bitbuf *, const bitbuf *);
+
+/* Offset of the first differing bit between the two `n` bit ranges, or `n`
+ * if they are equal
+ */
+size_t bitbuf_first_diff_range(const bitbuf *a, size_t astart,
+                               const bitbuf *b, size_t bstart, size_t n);
+
 /* Slice `n` elements to `dest` starting from the provided index */
 void bitbuf_slice(bitbuf *dest, const bitbuf *src, size_t start, size_t n);
 
@@ -161,7 +231,31 @@ void bitbuf_align(bitbuf *, bitbuf *);
 unsigned char bitbuf_getbit(const bitbuf *, size_t);
 void bitbuf_setbit(bitbuf *, size_t, int);
 
-/* Get / set a single byte with an offset going from left to right (MSB) */
+/* Set / clear / flip the `n` bits starting at `start` */
+void bitbuf_set_range(bitbuf *, size_t start, size_t n);
+void bitbuf_clear_range(bitbuf *, size_t start, size_t n);
+void bitbuf_flip_range(bitbuf *, size_t start, size_t n);
+
+/* Set `count` bits starting at `start`, `step` bits apart */
+void bitbuf_set_stride(bitbuf *, size_t start, size_t step, size_t count);
+
+/* Position of the first set / unset bit at or after `from`, or the length
+ * of the buffer if there is none
+ */
+size_t bitbuf_find_next_one(const bitbuf *, size_t from);
+size_t bitbuf_find_next_zero(const bitbuf *, size_t from);
+
+/* Position of the last set bit at or before `from`, or the length of the
+ * buffer if there is none
+ */
+size_t bitbuf_find_prev_one(const bitbuf *, size_t from);
+
+/* Write the positions of the first `cap` set bits in ascending order to
+ * `out`. Returns how many were written
+ */
+size_t bitbuf_decode_ones(const bitbuf *, uint64_t *out, size_t cap);
+
+/* Get / set the 8 bits at byte `pos` plus `offset` bits, as a memory byte */
 unsigned char bitbuf_getbyte(const bitbuf *, size_t pos, size_t offset);
 void bitbuf_setbyte(bitbuf *, size_t pos, size_t offset, unsigned char byte);
 
@@ -226,12 +320,127 @@ void bitbuf_xor(const bitbuf *, const bitbuf *, bitbuf *res);
 /* Add the two buffers in the numeric sense */
 void bitbuf_plus(const bitbuf *, const bitbuf *, bitbuf *res);
 
+/* Gather the bits of `src` selected by the ones of `mask` into `dest`
+ * (parallel bit extract). Both must be of the same length and `dest` ends
+ * up `bitbuf_weight(mask)` bits long
+ */
+void bitbuf_extract_mask(bitbuf *dest, const bitbuf *src, const bitbuf *mask);
+
+/* Scatter consecutive bits of `src` to the positions of the ones in `mask`
+ * (parallel bit deposit). `dest` is as long as `mask`, zero elsewhere
+ */
+void bitbuf_deposit_mask(bitbuf *dest, const bitbuf *src, const bitbuf *mask);
+
+/* Split `src` round-robin into `k` channels; bit i goes to `out[i % k]`
+ * k = 2, 4 and 8 have word-at-a-time kernels
+ */
+void bitbuf_deinterleave(const bitbuf *src, size_t k, bitbuf *out[]);
+
+/* Merge `k` buffers of the same length round-robin into `dest` */
+void bitbuf_interleave(bitbuf *dest, bitbuf *const in[], size_t k);
+
+/* Append `n` values of `width` bits each (1-32 / 1-64), keeping the low
+ * `width` bits of every value. They are laid out like bytes from
+ * bitbuf_addbyte(): most significant bit first, or least significant
+ * first under BITBUF_LSB_FIRST, so width 8 packs bytes
+ */
+void bitbuf_pack_u32(bitbuf *, const uint32_t *vals, size_t n, size_t width);
+void bitbuf_pack_u64(bitbuf *, const uint64_t *vals, size_t n, size_t width);
+
+/* Read `n` values of `width` bits packed from bit `pos` on */
+void bitbuf_unpack_u32(const bitbuf *, size_t pos, uint32_t *vals, size_t n,
+                       size_t width);
+void bitbuf_unpack_u64(const bitbuf *, size_t pos, uint64_t *vals, size_t n,
+                       size_t width);
+
+/* Value `i` of those packed from bit `pos` on */
+uint64_t bitbuf_unpack_at(const bitbuf *, size_t pos, size_t width, size_t i);
+
+/* HDLC bit stuffing: a 0 follows every five 1s in a row */
+void bitbuf_hdlc_stuff(bitbuf *dest, const bitbuf *src);
+
+/* Drop the 0 after every five 1s. Returns how many times six 1s were found
+ * in a row (a flag or abort), which are copied through as they are
+ */
+size_t bitbuf_hdlc_unstuff(bitbuf *dest, const bitbuf *src);
+
+/* NRZI with a 0 as a transition and a 1 as none, the line starting high */
+void bitbuf_nrzi_encode(bitbuf *dest, const bitbuf *src);
+void bitbuf_nrzi_decode(bitbuf *dest, const bitbuf *src);
+
+/* IEEE 802.3 sends a 0 as 10 and a 1 as 01, G. E. Thomas the opposite */
+enum { BITBUF_MANCHESTER_IEEE, BITBUF_MANCHESTER_THOMAS };
+
+void bitbuf_manchester_encode(bitbuf *dest, const bitbuf *src,
+                              int convention);
+
+/* Returns the number of invalid symbols (00 or 11, or a lone last bit) */
+size_t bitbuf_manchester_decode(bitbuf *dest, const bitbuf *src,
+                                int convention);
+
+/* CRC model using the Rocksoft parameters (width, poly, init, refin,
+ * refout, xorout). Declare it with `BITBUF_CRC_MODEL` or one of the presets
+ * below, then build the tables with `bitbuf_crc_init`
+ */
+typedef struct _bitbuf_crc_model {
+  size_t width; /* 1 to 64 */
+  unsigned long long poly;
+  unsigned long long init;
+  int refin;
+  int refout;
+  unsigned long long xorout;
+  unsigned long long table[8][256];
+  int ready;
+} bitbuf_crc_model;
+
+#define BITBUF_CRC_MODEL(width, poly, init, refin, refout, xorout) \
+  { width, poly, init, refin, refout, xorout, {{0}}, 0 }
+#define BITBUF_CRC16_CCITT BITBUF_CRC_MODEL(16, 0x1021, 0xffff, 0, 0, 0)
+#define BITBUF_CRC32 \
+  BITBUF_CRC_MODEL(32, 0x04c11db7, 0xffffffff, 1, 1, 0xffffffff)
+#define BITBUF_CRC32C \
+  BITBUF_CRC_MODEL(32, 0x1edc6f41, 0xffffffff, 1, 1, 0xffffffff)
+
+void bitbuf_crc_init(bitbuf_crc_model *);
+
+/* CRC of `nbits` bits starting at any bit offset `start`
+ * The bits are fed as consecutive 8-bit groups; with `refin` each group,
+ * including a trailing partial one, is fed least significant bit first
+ */
+unsigned long long bitbuf_crc(const bitbuf *, size_t start, size_t nbits,
+                              const bitbuf_crc_model *);
+
+/* 64-bit hash of the contents. Only the first `len` bits count, so equal
+ * buffers always hash equally
+ */
+uint64_t bitbuf_hash(const bitbuf *, uint64_t seed);
+
+/* Batched bitbuf_find() from the start, bitbuf_weight() and bitbuf_hash()
+ * over an array of `n` buffers, writing one result per buffer
+ */
+void bitbuf_find_batch(const bitbuf *srcs, size_t n, const bitbuf *pat,
+                       size_t garble, int *results);
+void bitbuf_weight_batch(const bitbuf *, size_t n, size_t *out);
+void bitbuf_hash_batch(const bitbuf *, size_t n, uint64_t seed,
+                       uint64_t *out);
+
+/* Transpose `src` viewed as a row-major `rows` x `cols` bit matrix into
+ * `dest`, which becomes a `cols` x `rows` matrix
+ */
+void bitbuf_transpose(bitbuf *dest, const bitbuf *src, size_t rows,
+                      size_t cols);
+
 /* Reverse `n` number of bits from the provided index */
 void bitbuf_reverse(bitbuf *, size_t start, size_t n);
 
 /* Reverse all bits in the buffer by `unit` bits */
 void bitbuf_reverse_all(bitbuf *, size_t unit);
 
+/* Reverse the bits of every byte, the partial last one included, to convert
+ * data written in the other bit order. The bits past `len` are cleared
+ */
+void bitbuf_flip_order(bitbuf *);
+
 /* Left and right shift */
 void bitbuf_lsh(bitbuf *, size_t);
 void bitbuf_rsh(bitbuf *, size_t);
@@ -277,6 +486,250 @@ size_t bitbuf_read(bitbuf *, FILE *);
  */
 size_t bitbuf_write(bitbuf *, FILE *);
 
+/* Called by the streaming search for every match with its bit offset from
+ * the beginning of the stream
+ */
+typedef void (*MatchPtr)(size_t pos, void *ctx);
+
+/* Search a stream for `pat` without loading all of it into memory
+ * Input is read in blocks of `MAX_BUF` bytes and only the last
+ * `pat->len - 1` bits are carried over between blocks, so memory use is
+ * bounded regardless of the input size. Works on pipes and sockets
+ * Returns the number of matches reported to `cb`
+ */
+size_t bitbuf_find_stream(FILE *, const bitbuf *pat, size_t garble,
+                          MatchPtr cb, void *ctx);
+size_t bitbuf_find_fd(int fd, const bitbuf *pat, size_t garble, MatchPtr cb,
+                      void *ctx);
+
+/* Asynchronous ingest
+ * A background thread reads `fd` into a ring of `depth` blocks of `block`
+ * bytes so block k + 1 is read while the caller processes block k
+ */
+typedef struct _bitbuf_ingest bitbuf_ingest;
+
+bitbuf_ingest *bitbuf_ingest_open(int fd, size_t block, size_t depth);
+
+/* Wait for the next block and point `view` at it. The view does not own its
+ * storage; it must not be grown and stays valid until handed back with
+ * `bitbuf_ingest_done`. `pos` (if not NULL) receives the bit offset of the
+ * view within the stream
+ * Returns 0 once the stream is exhausted
+ */
+int bitbuf_ingest_next(bitbuf_ingest *, bitbuf *view, size_t *pos);
+void bitbuf_ingest_done(bitbuf_ingest *, bitbuf *view);
+
+/* Stop the reader and free the ring. Outstanding views become invalid */
+void bitbuf_ingest_close(bitbuf_ingest *);
+
+/* Archives
+ * A container holding many buffers with their exact bit lengths and an
+ * offset index. Records are stored byte-aligned with the unused bits of
+ * their last byte cleared
+ */
+typedef struct _bitbuf_archive bitbuf_archive;
+
+/* Write `n` buffers to `fd` as an archive using batched `writev()`s
+ * Returns the number of BYTES written
+ */
+size_t bitbuf_archive_write(int fd, const bitbuf *bbs, size_t n);
+
+/* Map an archive into memory. Only the header is checked so opening is
+ * constant time regardless of the number of records
+ */
+bitbuf_archive *bitbuf_archive_open(const char *fname);
+size_t bitbuf_archive_count(const bitbuf_archive *);
+
+/* Point `view` at record `i` without copying. The view is read-only, must
+ * not be grown and is valid until `bitbuf_archive_close`
+ */
+void bitbuf_archive_get(const bitbuf_archive *, size_t i, bitbuf *view);
+void bitbuf_archive_close(bitbuf_archive *);
+
+/**
+ * Hash Map / Set
+ * ______________________________________
+ *
+ * Open-addressing table keyed by buffer contents. Keys are copied into an
+ * arena owned by the map, so callers may reuse their buffers right away
+ */
+typedef struct _bitbuf_map {
+  unsigned char *ctrl; /* per slot: hash tag, or empty */
+  bitbuf *keys;        /* views into the arena */
+  void **vals;
+  size_t cap;
+  size_t count;
+  uint64_t seed;
+  unsigned char **chunks; /* key arena */
+  size_t nchunks;
+  size_t chunk_size;
+  size_t used;
+} bitbuf_map;
+
+void bitbuf_map_init(bitbuf_map *);
+void bitbuf_map_release(bitbuf_map *);
+
+/* Insert or update `key`. Returns 1 if the key was not in the map yet */
+int bitbuf_map_put(bitbuf_map *, const bitbuf *key, void *val);
+
+/* Where the value of `key` is stored, or NULL if it is absent */
+void **bitbuf_map_get(const bitbuf_map *, const bitbuf *key);
+
+static inline size_t bitbuf_map_count(const bitbuf_map *m) { return m->count; }
+
+/* A set is a map without values */
+typedef bitbuf_map bitbuf_set;
+#define bitbuf_set_init bitbuf_map_init
+#define bitbuf_set_release bitbuf_map_release
+#define bitbuf_set_count bitbuf_map_count
+static inline int bitbuf_set_add(bitbuf_set *s, const bitbuf *key) {
+  return bitbuf_map_put(s, key, NULL);
+}
+static inline int bitbuf_set_has(const bitbuf_set *s, const bitbuf *key) {
+  return bitbuf_map_get(s, key) != NULL;
+}
+
+/**
+ * Expressions
+ * ______________________________________
+ *
+ * Bitwise expressions over buffers of the same length, built as a small DAG
+ * and evaluated lazily in one pass over cache-sized blocks. Every input is
+ * read once and the result written once, with no temporary buffers
+ *
+ *   bitbuf_expr e;
+ *   bitbuf_expr_init(&e);
+ *   int ab = bitbuf_expr_and(&e, bitbuf_expr_leaf(&e, &a),
+ *                            bitbuf_expr_leaf(&e, &b));
+ *   int cd = bitbuf_expr_andnot(&e, bitbuf_expr_leaf(&e, &c),
+ *                               bitbuf_expr_leaf(&e, &d));
+ *   bitbuf_expr_eval(&e, bitbuf_expr_or(&e, ab, cd), &res);
+ */
+#define BITBUF_EXPR_MAX 32
+
+typedef struct _bitbuf_expr {
+  struct {
+    int op;
+    int a, b;           /* operand node ids */
+    const bitbuf *leaf; /* input of a leaf node */
+  } node[BITBUF_EXPR_MAX];
+  size_t n;
+  size_t len; /* length shared by all the leaves */
+} bitbuf_expr;
+
+void bitbuf_expr_init(bitbuf_expr *);
+
+/* Each returns the id of the new node. Adding the same buffer twice gives
+ * back the same leaf
+ */
+int bitbuf_expr_leaf(bitbuf_expr *, const bitbuf *);
+int bitbuf_expr_and(bitbuf_expr *, int a, int b);
+int bitbuf_expr_or(bitbuf_expr *, int a, int b);
+int bitbuf_expr_xor(bitbuf_expr *, int a, int b);
+int bitbuf_expr_andnot(bitbuf_expr *, int a, int b); /* a & ~b */
+int bitbuf_expr_not(bitbuf_expr *, int a);
+
+/* Evaluate node `root` into `res`, which may be one of the leaves. The
+ * leaves must stay alive and unchanged until the expression is evaluated
+ */
+void bitbuf_expr_eval(const bitbuf_expr *, int root, bitbuf *res);
+
+/* Number of 1's node `root` evaluates to, without storing it anywhere */
+size_t bitbuf_expr_weight(const bitbuf_expr *, int root);
+
+/**
+ * Concurrent Bitmaps
+ * ______________________________________
+ *
+ * Lock-free bit updates for a bitmap shared between threads. They operate
+ * on aligned 64-bit words, so the buffer must come from
+ * `bitbuf_init_concurrent` and must not be resized while shared
+ */
+#define BITBUF_RELAXED __ATOMIC_RELAXED
+#define BITBUF_ACQ_REL __ATOMIC_ACQ_REL
+
+/* Initialize zero filled, with storage aligned for word atomics */
+void bitbuf_init_concurrent(bitbuf *, size_t);
+
+void bitbuf_setbit_atomic(bitbuf *, size_t n, int order);
+
+/* Set / clear bit `n`, returning its previous value */
+int bitbuf_test_and_set(bitbuf *, size_t n, int order);
+int bitbuf_test_and_clear(bitbuf *, size_t n, int order);
+
+/* OR all of `src` into `dest` starting at `pos`, a word at a time */
+void bitbuf_or_atomic_range(bitbuf *dest, size_t pos, const bitbuf *src,
+                            int order);
+
+/**
+ * Parallelism
+ * ______________________________________
+ *
+ * Bulk operations (op, weight, reverse_all, shifts, bin and hex) on buffers
+ * of at least `BITBUF_PAR_MIN` bytes are split across a persistent pool of
+ * worker threads. The pool is off until `bitbuf_set_threads` is called
+ */
+#ifndef BITBUF_PAR_MIN
+#define BITBUF_PAR_MIN (1 << 20)
+#endif
+
+/* Run bulk operations on `n` threads, the caller included. 0 or 1 stops the
+ * pool and makes everything serial again
+ */
+void bitbuf_set_threads(size_t n);
+
+size_t bitbuf_get_threads(void);
+
+/**
+ * Instrumentation
+ * ______________________________________
+ *
+ * Build with `-DBITBUF_STATS` to count calls, bytes and cycles spent in the
+ * hot functions below. Without it the hooks compile away entirely and
+ * `bitbuf_stats_snapshot` always reports zeros
+ */
+
+/* Functions tracked by the instrumentation layer */
+enum bitbuf_stat_fn {
+  BITBUF_STAT_GROW,
+  BITBUF_STAT_SLICE,
+  BITBUF_STAT_ADDBUF,
+  BITBUF_STAT_INSERT,
+  BITBUF_STAT_LSH,
+  BITBUF_STAT_RSH,
+  BITBUF_STAT_FIND,
+  BITBUF_STAT_REPLACE,
+  BITBUF_STAT_OP,
+  BITBUF_STAT_WEIGHT,
+  BITBUF_STAT_REVERSE,
+  BITBUF_STAT_READ,
+  BITBUF_STAT_WRITE,
+  BITBUF_STAT_NFN
+};
+
+typedef struct _bitbuf_fn_stats {
+  unsigned long long calls;
+  unsigned long long bytes;  /* bytes of buffer data touched */
+  unsigned long long cycles; /* rdtsc ticks (nanoseconds off x86) */
+} bitbuf_fn_stats;
+
+typedef struct _bitbuf_stats {
+  bitbuf_fn_stats fn[BITBUF_STAT_NFN];
+  unsigned long long reallocs;      /* realloc()s done by `bitbuf_grow` */
+  unsigned long long realloc_bytes; /* total size requested by them */
+  size_t alloc_bits;                /* bits currently allocated */
+  size_t peak_bits;                 /* most bits allocated at once */
+} bitbuf_stats;
+
+/* Merge the counters of every thread into `out`
+ * Counts are relative to the last `bitbuf_stats_reset()`
+ */
+void bitbuf_stats_snapshot(bitbuf_stats *out);
+void bitbuf_stats_reset(void);
+
+/* Name of a `bitbuf_stat_fn` entry, e.g. "grow" */
+const char *bitbuf_stats_name(int fn);
+
 /**
  * Utilities
  * ______________________________________
@@ -289,4 +742,8 @@ static inline unsigned char getbit(unsigned long data, size_t n) {
   return ((data >> n) & 0x01) == 1;
 }
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
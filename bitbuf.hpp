@@ -0,0 +1,262 @@
+#ifndef _BITBUF_HPP
+#define _BITBUF_HPP
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "bitbuf.h"
+
+/**
+ * C++ interface
+ * ______________________________________
+ *
+ * `bb::buffer` owns a bitbuf and releases it when it goes out of scope. It
+ * can be moved but not copied; call `clone()` for an explicit copy
+ * `bb::view` refers to a range of bits in a buffer it does not own
+ * `bb::fixed<N>` is a plain value of N bits whose operations are constexpr
+ */
+namespace bb {
+
+class buffer;
+
+/* Read-only range of bits inside a buffer. The buffer must outlive it */
+class view {
+ public:
+  view(const bitbuf *b, std::size_t start, std::size_t n) noexcept
+      : b_(b), start_(start), n_(n) {}
+
+  std::size_t size() const noexcept { return n_; }
+  bool empty() const noexcept { return n_ == 0; }
+  bool operator[](std::size_t i) const {
+    return bitbuf_getbit(b_, start_ + i);
+  }
+
+  view sub(std::size_t start, std::size_t n) const {
+    return view(b_, start_ + start, n);
+  }
+
+  /* Index of the first differing bit, or the shorter length */
+  std::size_t first_diff(const view &o) const {
+    std::size_t n = n_ < o.n_ ? n_ : o.n_;
+    return bitbuf_first_diff_range(b_, start_, o.b_, o.start_, n);
+  }
+
+  bool operator==(const view &o) const {
+    return n_ == o.n_ && first_diff(o) == n_;
+  }
+  bool operator!=(const view &o) const { return !(*this == o); }
+
+  inline buffer to_buffer() const;
+
+ private:
+  const bitbuf *b_;
+  std::size_t start_;
+  std::size_t n_;
+};
+
+class buffer {
+ public:
+  buffer() noexcept { bitbuf_init(&b_, 0); }
+
+  /* `n` zero bits */
+  explicit buffer(std::size_t n) { bitbuf_init_zero(&b_, n); }
+
+  /* Same format as bitbuf_init_str(), e.g. "0xcafe 0b101" */
+  static buffer parse(const char *str) {
+    buffer r;
+    bitbuf_init_str(&r.b_, str);
+    return r;
+  }
+
+  buffer(const buffer &) = delete;
+  buffer &operator=(const buffer &) = delete;
+
+  buffer(buffer &&o) noexcept : b_(o.b_) { bitbuf_init(&o.b_, 0); }
+  buffer &operator=(buffer &&o) noexcept {
+    if (this != &o) {
+      bitbuf_release(&b_);
+      b_ = o.b_;
+      bitbuf_init(&o.b_, 0);
+    }
+    return *this;
+  }
+
+  ~buffer() { bitbuf_release(&b_); }
+
+  buffer clone() const {
+    buffer r;
+    bitbuf_copy(&r.b_, &b_);
+    return r;
+  }
+
+  /* The underlying bitbuf for the rest of the C API */
+  bitbuf *get() noexcept { return &b_; }
+  const bitbuf *get() const noexcept { return &b_; }
+
+  std::size_t size() const noexcept { return b_.len; }
+  bool empty() const noexcept { return b_.len == 0; }
+  bool operator[](std::size_t i) const { return bitbuf_getbit(&b_, i); }
+  void set(std::size_t i, bool v = true) { bitbuf_setbit(&b_, i, v); }
+  std::size_t count() const { return bitbuf_weight(&b_); }
+
+  buffer &push_back(bool v) {
+    bitbuf_addbit(&b_, v);
+    return *this;
+  }
+  buffer &append(const buffer &o) {
+    bitbuf_addbuf(&b_, &o.b_);
+    return *this;
+  }
+
+  view all() const noexcept { return view(&b_, 0, b_.len); }
+  view sub(std::size_t start, std::size_t n) const {
+    return view(&b_, start, n);
+  }
+
+  std::string bin() const {
+    std::string s(b_.len + 1, '\0');
+    bitbuf_bin(&b_, &s[0]);
+    s.resize(b_.len);
+    return s;
+  }
+
+  /* Needs a length that is a multiple of 4 */
+  std::string hex() const {
+    std::string s(BYTE_LEN(b_.len) * 2 + 1, '\0');
+    bitbuf_hex(&b_, &s[0]);
+    s.resize(b_.len / 4);
+    return s;
+  }
+
+  /* Operands must have the same length, like bitbuf_op() */
+  friend buffer operator&(const buffer &a, const buffer &b) {
+    buffer r;
+    bitbuf_and(&a.b_, &b.b_, &r.b_);
+    return r;
+  }
+  friend buffer operator|(const buffer &a, const buffer &b) {
+    buffer r;
+    bitbuf_or(&a.b_, &b.b_, &r.b_);
+    return r;
+  }
+  friend buffer operator^(const buffer &a, const buffer &b) {
+    buffer r;
+    bitbuf_xor(&a.b_, &b.b_, &r.b_);
+    return r;
+  }
+
+  /* Ordered like bitbuf_cmp_lex() */
+  friend bool operator==(const buffer &a, const buffer &b) {
+    return bitbuf_cmp_lex(&a.b_, &b.b_) == 0;
+  }
+  friend bool operator!=(const buffer &a, const buffer &b) {
+    return !(a == b);
+  }
+  friend bool operator<(const buffer &a, const buffer &b) {
+    return bitbuf_cmp_lex(&a.b_, &b.b_) < 0;
+  }
+
+ private:
+  bitbuf b_;
+};
+
+inline buffer view::to_buffer() const {
+  buffer r;
+  if (n_) bitbuf_init_sub(r.get(), b_, start_, n_);
+  return r;
+}
+
+/* N bits held by value, 64 to a word with bit 0 on top of the first word
+ * Every loop runs over a word count known at compile time
+ */
+template <std::size_t N>
+class fixed {
+  static_assert(N > 0, "fixed needs at least one bit");
+
+ public:
+  static constexpr std::size_t words = (N + 63) / 64;
+
+  constexpr fixed() noexcept : w_{} {}
+
+  static constexpr std::size_t size() noexcept { return N; }
+
+  constexpr bool operator[](std::size_t i) const noexcept {
+    return w_[i / 64] >> (63 - i % 64) & 1;
+  }
+  constexpr bool get(std::size_t i) const noexcept { return (*this)[i]; }
+
+  constexpr fixed &set(std::size_t i, bool v = true) noexcept {
+    std::uint64_t m = 1ULL << (63 - i % 64);
+    w_[i / 64] = v ? w_[i / 64] | m : w_[i / 64] & ~m;
+    return *this;
+  }
+
+  constexpr std::size_t count() const noexcept {
+    std::size_t c = 0;
+    for (std::size_t i = 0; i < words; ++i) c += __builtin_popcountll(w_[i]);
+    return c;
+  }
+
+  constexpr fixed operator&(const fixed &o) const noexcept {
+    fixed r;
+    for (std::size_t i = 0; i < words; ++i) r.w_[i] = w_[i] & o.w_[i];
+    return r;
+  }
+  constexpr fixed operator|(const fixed &o) const noexcept {
+    fixed r;
+    for (std::size_t i = 0; i < words; ++i) r.w_[i] = w_[i] | o.w_[i];
+    return r;
+  }
+  constexpr fixed operator^(const fixed &o) const noexcept {
+    fixed r;
+    for (std::size_t i = 0; i < words; ++i) r.w_[i] = w_[i] ^ o.w_[i];
+    return r;
+  }
+  constexpr fixed operator~() const noexcept {
+    fixed r;
+    for (std::size_t i = 0; i < words; ++i) r.w_[i] = ~w_[i];
+    r.clear_tail();
+    return r;
+  }
+
+  constexpr bool operator==(const fixed &o) const noexcept {
+    for (std::size_t i = 0; i < words; ++i)
+      if (w_[i] != o.w_[i]) return false;
+    return true;
+  }
+  constexpr bool operator!=(const fixed &o) const noexcept {
+    return !(*this == o);
+  }
+
+  /* First N bits of `b`, zero filled if it is shorter */
+  static fixed from(const bitbuf *b) {
+    fixed r;
+    std::size_t n = b->len < N ? b->len : N;
+    for (std::size_t i = 0; i < n; ++i) r.set(i, bitbuf_getbit(b, i));
+    return r;
+  }
+
+  buffer to_buffer() const {
+    buffer r(N);
+    for (std::size_t i = 0; i < BYTE_LEN(N); ++i) {
+      std::uint64_t c = w_[i / 8] >> (56 - 8 * (i % 8)) & 0xff;
+#ifdef BITBUF_LSB_FIRST
+      c = (c * 0x0202020202ULL & 0x010884422010ULL) % 1023; /* bit reverse */
+#endif
+      r.get()->buf[i] = static_cast<unsigned char>(c);
+    }
+    return r;
+  }
+
+ private:
+  /* Bits past N stay zero so count() and == need no masking */
+  constexpr void clear_tail() noexcept {
+    if (N % 64) w_[words - 1] &= ~0ULL << (64 - N % 64);
+  }
+
+  std::uint64_t w_[words];
+};
+
+}  // namespace bb
+
+#endif
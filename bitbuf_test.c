@@ -1,12 +1,28 @@
 #include "bitbuf.h"
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 int TEST_CNT = 0;
 
+/* Mask of the unused bits in the last byte of an `n` bit buffer, and the
+ * memory byte holding the bits that a hex string spells as `x`
+ */
+#define REV8(x) ((int)(((x) * 0x0202020202ULL & 0x010884422010ULL) % 1023))
+#ifdef BITBUF_LSB_FIRST
+#define GARBAGE(n) (0xff << (n) % 8 & 0xff)
+#define RAW(x) REV8(x)
+#else
+#define GARBAGE(n) (0xff >> (n) % 8)
+#define RAW(x) (x)
+#endif
+
 void success(char *fname) { printf("%-20sOK\n", fname); }
 
 int assert_str(char *res, char *expected, char *fname) {
@@ -59,6 +75,9 @@ void test_ascii() {
   char str[11];
   bitbuf bb = BITBUF_INIT;
   bitbuf_init_str(&bb, "0x68656c6c6f776f726c64");
+#ifdef BITBUF_LSB_FIRST
+  bitbuf_flip_order(&bb);
+#endif
   bitbuf_ascii(&bb, str);
 
   assert_str(str, "helloworld", "ascii");
@@ -82,11 +101,11 @@ void test_addbyte() {
 
   bitbuf b1 = BITBUF_INIT;
   bitbuf_init_str(&b1, "0b000100010010");
-  bitbuf_addbyte(&b1, 0x34);
-  bitbuf_addbyte(&b1, 0x56);
-  bitbuf_addbyte(&b1, 0x78);
+  bitbuf_addbyte(&b1, RAW(0x34));
+  bitbuf_addbyte(&b1, RAW(0x56));
+  bitbuf_addbyte(&b1, RAW(0x78));
   bitbuf_addstr_hex(&b1, "9");
-  bitbuf_addbyte(&b1, 0xab);
+  bitbuf_addbyte(&b1, RAW(0xab));
 
   bitbuf_hex(&b1, str);
 
@@ -112,15 +131,19 @@ void test_addbit() {
 }
 
 void test_insert() {
-  char str[20];
+  char str[32];
 
   bitbuf b1 = BITBUF_INIT;
   bitbuf_init_str(&b1, "0b10101000");
   bitbuf_insert_bit(&b1, 1, 3);
   bitbuf_insert_bit(&b1, 1, b1.len);
   bitbuf_bin(&b1, str);
-  bitbuf_release(&b1);
   assert_str(str, "1011010001", "insert");
+
+  bitbuf_insert(&b1, &b1, 4);
+  bitbuf_bin(&b1, str);
+  assert_str(str, "10111011010001010001", "insert-self");
+  bitbuf_release(&b1);
   success("insert");
 }
 
@@ -134,6 +157,7 @@ void test_prepend() {
 
   bitbuf_prependbuf(&b1, &b2);
   bitbuf_hex(&b1, str);
+  assert_str(str, "ff3579", "prepend");
   success("prepend");
   bitbuf_release(&b1);
   bitbuf_release(&b2);
@@ -145,9 +169,9 @@ void test_initstr() {
   bitbuf_init_str(&bb, "0xf 0b0001001001001000 0x0deadf 0b");
   bitbuf_hex(&bb, str);
   assert_str(str, "f12480deadf", "initstr");
-  assert_num(bb.buf[0], 0xf1, "initstr-1");
-  assert_num(bb.buf[1], 0x24, "initstr-2");
-  assert_num(bb.buf[4], 0xad, "initstr-3");
+  assert_num(bb.buf[0], RAW(0xf1), "initstr-1");
+  assert_num(bb.buf[1], RAW(0x24), "initstr-2");
+  assert_num(bb.buf[4], RAW(0xad), "initstr-3");
 
   bitbuf_reset(&bb);
   memset(str, '\0', 20);
@@ -160,6 +184,57 @@ void test_initstr() {
   bitbuf_release(&bb);
 }
 
+/* Small deterministic generator so failures are reproducible */
+static unsigned long long rnd_state = 88172645463325252ULL;
+static unsigned long long rnd() {
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return rnd_state;
+}
+
+static void fill_rnd(bitbuf *bb, size_t n) {
+  size_t i;
+  bitbuf_init_zero(bb, n);
+  for (i = 0; i < n; ++i) bitbuf_setbit(bb, i, rnd() & 1);
+}
+
+void test_copy_bits() {
+  size_t i, j, dpos, spos, n;
+  bitbuf src = BITBUF_INIT;
+  bitbuf dst = BITBUF_INIT;
+  bitbuf ref = BITBUF_INIT;
+  fill_rnd(&src, 700);
+  fill_rnd(&dst, 700);
+
+  for (i = 0; i < 400; ++i) {
+    int self = i % 2;
+    bitbuf *from = self ? &dst : &src;
+    n = rnd() % 300;
+    spos = rnd() % (700 - n);
+    dpos = rnd() % (700 - n);
+
+    bitbuf_reset(&ref);
+    bitbuf_copy(&ref, &dst);
+    for (j = 0; j < n; ++j)
+      bitbuf_setbit(&ref, dpos + j, bitbuf_getbit(from, spos + j));
+    bitbuf_copy_bits(&dst, dpos, from, spos, n);
+    assert_num(0, bitbuf_cmp(&ref, &dst), "copy_bits");
+  }
+
+  /* Appending past the end grows the buffer */
+  bitbuf_copy_bits(&dst, dst.len, &src, 3, 100);
+  assert_num(800, dst.len, "copy_bits-grow");
+  for (j = 0; j < 100; ++j)
+    assert_num(bitbuf_getbit(&src, 3 + j), bitbuf_getbit(&dst, 700 + j),
+               "copy_bits-grow");
+
+  bitbuf_release(&src);
+  bitbuf_release(&dst);
+  bitbuf_release(&ref);
+  success("copy_bits");
+}
+
 void test_getbit() {
   bitbuf bb = BITBUF_INIT;
   bitbuf_init_str(&bb, "0xdeadbeef");
@@ -198,13 +273,18 @@ void test_setbit() {
 void test_setgetbyte() {
   bitbuf bb = BITBUF_INIT;
   bitbuf_init_str(&bb, "0xdeadbeef 0b1");
-  assert_num(0xdf, bitbuf_getbyte(&bb, 3, 1), "getbyte");
-  assert_num(0xdf, bitbuf_getbyte(&bb, 3, 1), "getbyte");
+  assert_num(RAW(0xdf), bitbuf_getbyte(&bb, 3, 1), "getbyte");
+  assert_num(RAW(0xdf), bitbuf_getbyte(&bb, 3, 1), "getbyte");
   success("getbyte");
 
   bitbuf_setbyte(&bb, 1, 3, 0xaa);
   assert_num(0xaa, bitbuf_getbyte(&bb, 1, 3), "getbyte");
+  /* The byte's bits one place on, then the next bit of 0xdeadbeef (a 1) */
+#ifdef BITBUF_LSB_FIRST
+  assert_num(0xd5, bitbuf_getbyte(&bb, 1, 4), "getbyte");
+#else
   assert_num(0x55, bitbuf_getbyte(&bb, 1, 4), "getbyte");
+#endif
   success("setbyte");
   bitbuf_release(&bb);
 }
@@ -272,6 +352,721 @@ void test_op() {
   bitbuf_release(&res);
 }
 
+void test_mask() {
+  size_t i, j, k;
+  char str[8];
+  bitbuf src = BITBUF_INIT;
+  bitbuf mask = BITBUF_INIT;
+  bitbuf res = BITBUF_INIT;
+  bitbuf back = BITBUF_INIT;
+
+  for (i = 0; i < 20; ++i) {
+    fill_rnd(&src, 1 + rnd() % 300);
+    fill_rnd(&mask, src.len);
+
+    bitbuf_extract_mask(&res, &src, &mask);
+    assert_num(bitbuf_weight(&mask), res.len, "extract_mask");
+    for (j = k = 0; j < src.len; ++j)
+      if (bitbuf_getbit(&mask, j))
+        assert_num(bitbuf_getbit(&src, j), bitbuf_getbit(&res, k++),
+                   "extract_mask");
+
+    /* Depositing the extracted bits gives back `src & mask` */
+    bitbuf_deposit_mask(&back, &res, &mask);
+    assert_num(src.len, back.len, "deposit_mask");
+    for (j = 0; j < src.len; ++j)
+      assert_num(bitbuf_getbit(&src, j) & bitbuf_getbit(&mask, j),
+                 bitbuf_getbit(&back, j), "deposit_mask");
+
+    bitbuf_release(&src);
+    bitbuf_release(&mask);
+  }
+
+  /* Garbage past the end of the mask selects nothing */
+  bitbuf_init_str(&src, "0b11111");
+  bitbuf_init_str(&mask, "0b10100");
+  mask.buf[0] |= GARBAGE(mask.len);
+  bitbuf_extract_mask(&res, &src, &mask);
+  assert_num(2, res.len, "extract_mask-tail");
+  bitbuf_release(&res);
+  bitbuf_init_str(&res, "0b11");
+  bitbuf_deposit_mask(&back, &res, &mask);
+  bitbuf_bin(&back, str);
+  assert_str(str, "10100", "deposit_mask-tail");
+  bitbuf_release(&src);
+  bitbuf_release(&mask);
+
+  bitbuf_release(&res);
+  bitbuf_release(&back);
+  success("mask");
+}
+
+void test_interleave() {
+  const size_t ks[] = {2, 3, 4, 8};
+  size_t i, j, k;
+  bitbuf src = BITBUF_INIT;
+  bitbuf back = BITBUF_INIT;
+  bitbuf chans[8], *out[8];
+  for (i = 0; i < 8; ++i) {
+    bitbuf_init(&chans[i], 0);
+    out[i] = &chans[i];
+  }
+
+  for (i = 0; i < 4; ++i) {
+    k = ks[i];
+    fill_rnd(&src, 1000 + i);
+    bitbuf_deinterleave(&src, k, out);
+    for (j = 0; j < src.len; ++j)
+      assert_num(bitbuf_getbit(&src, j), bitbuf_getbit(out[j % k], j / k),
+                 "deinterleave");
+    assert_num((src.len + k - 1) / k, out[0]->len, "deinterleave");
+
+    /* Even split so the channels can go back together */
+    bitbuf_release(&src);
+    fill_rnd(&src, 64 * k + 8 * k);
+    bitbuf_deinterleave(&src, k, out);
+    bitbuf_interleave(&back, out, k);
+    assert_num(0, bitbuf_cmp(&src, &back), "interleave");
+    bitbuf_release(&src);
+  }
+
+  for (i = 0; i < 8; ++i) bitbuf_release(&chans[i]);
+  bitbuf_release(&back);
+  success("interleave");
+}
+
+void test_pack() {
+  const size_t n = 203, lead = 3;
+  size_t i, w, b, pos;
+  uint64_t in[203], out[203], m;
+  uint32_t in32[203], out32[203];
+  bitbuf bb = BITBUF_INIT;
+
+  for (w = 1; w <= 64; ++w) {
+    m = w == 64 ? ~0ULL : (1ULL << w) - 1;
+    for (i = 0; i < n; ++i) in[i] = rnd();
+
+    /* Start mid-byte, with a value the packed bits must not disturb */
+    bitbuf_init_str(&bb, "0b101");
+    bitbuf_pack_u64(&bb, in, n, w);
+    assert_num(lead + n * w, bb.len, "pack-len");
+    assert_num(1, bitbuf_getbit(&bb, 0), "pack-lead");
+    assert_num(0, bitbuf_getbit(&bb, 1), "pack-lead");
+    assert_num(1, bitbuf_getbit(&bb, 2), "pack-lead");
+
+    bitbuf_unpack_u64(&bb, lead, out, n, w);
+    for (i = 0; i < n; ++i) {
+      assert_num(1, out[i] == (in[i] & m), "unpack-u64");
+      assert_num(1, bitbuf_unpack_at(&bb, lead, w, i) == (in[i] & m),
+                 "unpack-at");
+    }
+
+    /* Bit order of the values follows the buffer */
+    for (i = 0; i < n; i += 37)
+      for (b = 0; b < w; ++b) {
+#ifdef BITBUF_LSB_FIRST
+        pos = lead + i * w + b;
+#else
+        pos = lead + i * w + w - 1 - b;
+#endif
+        assert_num(in[i] >> b & 1, bitbuf_getbit(&bb, pos), "pack-order");
+      }
+    bitbuf_release(&bb);
+
+    if (w > 32) continue;
+    for (i = 0; i < n; ++i) in32[i] = (uint32_t)rnd();
+    bitbuf_pack_u32(&bb, in32, n, w);
+    bitbuf_unpack_u32(&bb, 0, out32, n, w);
+    for (i = 0; i < n; ++i)
+      assert_num(1, out32[i] == (in32[i] & m), "unpack-u32");
+    bitbuf_release(&bb);
+  }
+
+  /* Width 8 lays out plain bytes */
+  for (i = 0; i < 100; ++i) in32[i] = (uint32_t)(i * 37);
+  bitbuf_pack_u32(&bb, in32, 100, 8);
+  for (i = 0; i < 100; ++i) assert_num(i * 37 & 0xff, bb.buf[i], "pack-bytes");
+  bitbuf_release(&bb);
+
+  success("pack");
+}
+
+void test_transpose() {
+  const size_t dims[][2] = {{8, 8}, {64, 64}, {70, 130}, {3, 200}, {600, 9}};
+  size_t i, r, c, rows, cols;
+  bitbuf src = BITBUF_INIT;
+  bitbuf res = BITBUF_INIT;
+  bitbuf back = BITBUF_INIT;
+
+  for (i = 0; i < 5; ++i) {
+    rows = dims[i][0];
+    cols = dims[i][1];
+    fill_rnd(&src, rows * cols);
+
+    bitbuf_transpose(&res, &src, rows, cols);
+    assert_num(src.len, res.len, "transpose");
+    for (r = 0; r < rows; ++r)
+      for (c = 0; c < cols; ++c)
+        assert_num(bitbuf_getbit(&src, r * cols + c),
+                   bitbuf_getbit(&res, c * rows + r), "transpose");
+
+    bitbuf_transpose(&back, &res, cols, rows);
+    assert_num(0, bitbuf_cmp(&src, &back), "transpose-back");
+    bitbuf_release(&src);
+  }
+
+  bitbuf_release(&res);
+  bitbuf_release(&back);
+  success("transpose");
+}
+
+void test_crc() {
+  bitbuf_crc_model ccitt = BITBUF_CRC16_CCITT;
+  bitbuf_crc_model crc32 = BITBUF_CRC32;
+  bitbuf_crc_model crc32c = BITBUF_CRC32C;
+  bitbuf_crc_model crc5 = BITBUF_CRC_MODEL(5, 0x05, 0x1f, 1, 1, 0x1f);
+  bitbuf_crc_init(&ccitt);
+  bitbuf_crc_init(&crc32);
+  bitbuf_crc_init(&crc32c);
+  bitbuf_crc_init(&crc5);
+
+  /* "123456789", the usual check string, behind 3 bits of junk */
+  size_t i, n = 9 * 8;
+  bitbuf bb = BITBUF_INIT;
+  bitbuf_init_str(&bb, "0b101");
+  for (i = 0; i < 9; ++i) bitbuf_addbyte(&bb, '1' + i);
+  bitbuf_addstr_bin(&bb, "11");
+
+  assert_num(0x29b1, bitbuf_crc(&bb, 3, n, &ccitt), "crc-ccitt");
+  assert_num(0xcbf43926, bitbuf_crc(&bb, 3, n, &crc32), "crc-32");
+  assert_num(0xe3069283, bitbuf_crc(&bb, 3, n, &crc32c), "crc-32c");
+  assert_num(0x19, bitbuf_crc(&bb, 3, n, &crc5), "crc-5");
+
+  /* Long runs go through the 8-byte path */
+  bitbuf big = BITBUF_INIT;
+  for (i = 0; i < 100; ++i) bitbuf_addbyte(&big, i);
+  assert_num(0x58c932f5, bitbuf_crc(&big, 0, big.len, &crc32), "crc-32");
+  assert_num(0xc1caebe5, bitbuf_crc(&big, 0, big.len, &crc32c), "crc-32c");
+
+  bitbuf_release(&bb);
+  bitbuf_release(&big);
+  success("crc");
+}
+
+void test_cmp() {
+  bitbuf a = BITBUF_INIT;
+  bitbuf b = BITBUF_INIT;
+  bitbuf_init_str(&a, "0b1011");
+  bitbuf_init_str(&b, "0b1011");
+  b.buf[0] |= GARBAGE(4);
+  assert_num(0, bitbuf_cmp(&a, &b), "cmp-garbage");
+
+  bitbuf_addstr(&b, "0", 2, 1);
+  assert_num(4, bitbuf_first_diff(&a, &b), "first_diff-prefix");
+  assert_num(-1, bitbuf_cmp_lex(&a, &b), "cmp_lex-prefix");
+  assert_num(1, bitbuf_cmp_lex(&b, &a), "cmp_lex-prefix");
+  bitbuf_setbit(&b, 2, 0);
+  assert_num(-1, bitbuf_cmp_lex(&b, &a), "cmp_lex");
+  bitbuf_release(&a);
+  bitbuf_release(&b);
+
+  /* Random ranges at every phase against a bit-by-bit walk */
+  size_t i, j, k, n;
+  bitbuf sub = BITBUF_INIT;
+  fill_rnd(&a, 2000);
+  for (i = 0; i < 300; ++i) {
+    size_t as = rnd() % 700, bs = rnd() % 700;
+    n = rnd() % 1200;
+    fill_rnd(&b, bs);
+    bitbuf_init_sub(&sub, &a, as, n);
+    if (n && i % 3) {
+      k = rnd() % n;
+      bitbuf_setbit(&sub, k, !bitbuf_getbit(&sub, k));
+    }
+    bitbuf_addbuf(&b, &sub);
+    for (j = 0; j < 100; ++j) bitbuf_addbit(&b, rnd() & 1);
+
+    for (j = 0; j < n; ++j)
+      if (bitbuf_getbit(&a, as + j) != bitbuf_getbit(&b, bs + j)) break;
+    assert_num(j, bitbuf_first_diff_range(&a, as, &b, bs, n), "first_diff");
+    int want = j == n ? 0 : bitbuf_getbit(&a, as + j) ? 1 : -1;
+    assert_num(want, bitbuf_cmp_range(&a, as, &b, bs, n), "cmp_range");
+    bitbuf_release(&sub);
+    bitbuf_release(&b);
+  }
+  bitbuf_release(&a);
+  success("cmp");
+}
+
+/* Bulk operations give the same answer on the pool as serially */
+void test_parallel() {
+  size_t i, j, n = BITBUF_PAR_MIN * 8 + 37;
+  bitbuf a = BITBUF_INIT;
+  bitbuf b = BITBUF_INIT;
+  bitbuf res[2] = {BITBUF_INIT, BITBUF_INIT};
+  size_t weight[2];
+  char *str[2];
+
+  bitbuf_init_zero(&a, n);
+  bitbuf_init_zero(&b, n);
+  for (i = 0; i < n / 8; ++i) {
+    a.buf[i] = rnd();
+    b.buf[i] = rnd();
+  }
+  str[0] = (char *)malloc(n + 1);
+  str[1] = (char *)malloc(n + 1);
+
+  for (j = 0; j < 2; ++j) {
+    bitbuf_set_threads(j ? 3 : 1);
+    assert_num(j ? 3 : 1, bitbuf_get_threads(), "threads");
+    bitbuf_init(&res[j], 0);
+    bitbuf_xor(&a, &b, &res[j]);
+    weight[j] = bitbuf_weight(&res[j]);
+    bitbuf_reverse_all(&res[j], 5);
+    bitbuf_lsh(&res[j], 13);
+    bitbuf_rsh(&res[j], 11);
+    bitbuf_bin(&res[j], str[j]);
+  }
+  assert_num(weight[0], weight[1], "parallel-weight");
+  assert_num(0, bitbuf_cmp(&res[0], &res[1]), "parallel-ops");
+  assert_num(0, strcmp(str[0], str[1]), "parallel-bin");
+
+  bitbuf_setlen(&res[0], n - 37);
+  bitbuf_setlen(&res[1], n - 37);
+  bitbuf_hex(&res[1], str[1]);
+  bitbuf_set_threads(1);
+  bitbuf_hex(&res[0], str[0]);
+  assert_num(0, strcmp(str[0], str[1]), "parallel-hex");
+
+  free(str[0]);
+  free(str[1]);
+  bitbuf_release(&a);
+  bitbuf_release(&b);
+  bitbuf_release(&res[0]);
+  bitbuf_release(&res[1]);
+  success("parallel");
+}
+
+void test_ranges() {
+  size_t i, j, start, n, step;
+  bitbuf bb = BITBUF_INIT;
+  bitbuf ref = BITBUF_INIT;
+
+  for (i = 0; i < 400; ++i) {
+    fill_rnd(&bb, 1000);
+    bitbuf_copy(&ref, &bb);
+    start = rnd() % 1000;
+    n = rnd() % (1000 - start + 1);
+
+    switch (i % 4) {
+      case 0:
+        bitbuf_set_range(&bb, start, n);
+        for (j = start; j < start + n; ++j) bitbuf_setbit(&ref, j, 1);
+        break;
+      case 1:
+        bitbuf_clear_range(&bb, start, n);
+        for (j = start; j < start + n; ++j) bitbuf_setbit(&ref, j, 0);
+        break;
+      case 2:
+        bitbuf_flip_range(&bb, start, n);
+        for (j = start; j < start + n; ++j)
+          bitbuf_setbit(&ref, j, !bitbuf_getbit(&ref, j));
+        break;
+      case 3:
+        step = 1 + rnd() % (i % 8 ? 70 : 300);
+        n = rnd() % ((999 - start) / step + 2);
+        bitbuf_set_stride(&bb, start, step, n);
+        for (j = 0; j < n; ++j) bitbuf_setbit(&ref, start + j * step, 1);
+        break;
+    }
+    assert_num(0, bitbuf_cmp(&bb, &ref), "ranges");
+    bitbuf_release(&bb);
+    bitbuf_release(&ref);
+  }
+  success("ranges");
+}
+
+void test_scan() {
+  size_t i, j, k, n = 3001;
+  uint64_t out[3001];
+  bitbuf bb = BITBUF_INIT;
+
+  bitbuf_init_zero(&bb, n);
+  for (i = 0; i < 100; ++i) bitbuf_setbit(&bb, rnd() % n, 1);
+  bitbuf_set_range(&bb, 1000, 300);
+  bitbuf_setbit(&bb, n - 1, 1);
+
+  size_t cnt = bitbuf_decode_ones(&bb, out, n);
+  assert_num(bitbuf_weight(&bb), cnt, "decode_ones");
+  for (i = 0, k = 0; i < n; ++i) {
+    for (j = i; j < n && !bitbuf_getbit(&bb, j); ++j)
+      ;
+    assert_num(j, bitbuf_find_next_one(&bb, i), "find_next_one");
+    for (j = i; j < n && bitbuf_getbit(&bb, j); ++j)
+      ;
+    assert_num(j, bitbuf_find_next_zero(&bb, i), "find_next_zero");
+    for (j = i + 1; j > 0 && !bitbuf_getbit(&bb, j - 1); --j)
+      ;
+    assert_num(j ? j - 1 : n, bitbuf_find_prev_one(&bb, i), "find_prev_one");
+    if (bitbuf_getbit(&bb, i)) assert_num(i, out[k++], "decode_ones");
+  }
+  assert_num(5, bitbuf_decode_ones(&bb, out, 5), "decode_ones-cap");
+  assert_num(n, bitbuf_find_next_one(&bb, n), "find_next_one-end");
+
+  bitbuf_set_range(&bb, 0, n);
+  assert_num(n, bitbuf_find_next_zero(&bb, 0), "find_next_zero-end");
+  bitbuf_release(&bb);
+  success("scan");
+}
+
+void test_find_compiled() {
+  size_t i, j, m, off;
+  bitbuf src = BITBUF_INIT;
+  bitbuf pat = BITBUF_INIT;
+
+  for (i = 0; i < 300; ++i) {
+    fill_rnd(&src, 600 + rnd() % 400);
+    m = 9 + rnd() % 100;
+    off = rnd() % 500;
+    /* Plant the pattern most of the time, sometimes twice */
+    bitbuf_init_sub(&pat, &src, rnd() % (src.len - m), m);
+    if (i % 4) bitbuf_copy_bits(&src, rnd() % (src.len - m), &pat, 0, m);
+    if (i % 3 == 0) bitbuf_copy_bits(&src, rnd() % (src.len - m), &pat, 0, m);
+    if (i % 5 == 0) off = src.len - m + 1;
+
+    bitbuf_pattern *cp = bitbuf_pattern_compile(&pat);
+    int want = -1;
+    for (j = off; j + m <= src.len; ++j)
+      if (!bitbuf_cmp_range(&src, j, &pat, 0, m)) {
+        want = j;
+        break;
+      }
+    assert_num(want, bitbuf_find_compiled(&src, cp, off), "find_compiled");
+
+    bitbuf_pattern_free(cp);
+    bitbuf_release(&pat);
+    bitbuf_release(&src);
+  }
+  success("find_compiled");
+}
+
+void test_batch() {
+  size_t i, j, n = 100;
+  bitbuf bbs[100];
+  bitbuf pat[2] = {BITBUF_INIT, BITBUF_INIT};
+  int hits[100];
+  size_t weights[100];
+  uint64_t hashes[100];
+
+  bitbuf_init_str(&pat[0], "0xa5");
+  bitbuf_init_str(&pat[1], "0xdeadbeefcafebabe01");
+  for (i = 0; i < n; ++i) {
+    fill_rnd(&bbs[i], 100 + rnd() % 1900);
+    if (i % 2) bitbuf_copy_bits(&bbs[i], i, &pat[1], 0, pat[1].len);
+  }
+
+  bitbuf_weight_batch(bbs, n, weights);
+  bitbuf_hash_batch(bbs, n, 7, hashes);
+  for (i = 0; i < n; ++i) {
+    assert_num(bitbuf_weight(&bbs[i]), weights[i], "weight_batch");
+    assert_num(1, bitbuf_hash(&bbs[i], 7) == hashes[i], "hash_batch");
+  }
+  for (j = 0; j < 2; ++j) {
+    bitbuf_find_batch(bbs, n, &pat[j], j, hits);
+    for (i = 0; i < n; ++i)
+      assert_num(bitbuf_find(&bbs[i], &pat[j], j, 0), hits[i], "find_batch");
+    bitbuf_find_batch(bbs, n, &pat[j], 0, hits);
+    for (i = 0; i < n; ++i)
+      assert_num(bitbuf_find(&bbs[i], &pat[j], 0, 0), hits[i], "find_batch");
+  }
+
+  for (i = 0; i < n; ++i) bitbuf_release(&bbs[i]);
+  bitbuf_release(&pat[0]);
+  bitbuf_release(&pat[1]);
+  success("batch");
+}
+
+/* Edit distance of `pat` against the best substring of `src` starting at
+ * or after `off` and ending at each position, by dynamic programming
+ */
+static void edit_columns(const bitbuf *src, const bitbuf *pat, size_t off,
+                         size_t *out) {
+  size_t i, j, m = pat->len;
+  size_t *col = (size_t *)malloc((m + 1) * sizeof(size_t));
+  size_t diag, up;
+  for (i = 0; i <= m; ++i) col[i] = i;
+  for (j = off; j < src->len; ++j) {
+    diag = col[0];
+    col[0] = 0;
+    for (i = 1; i <= m; ++i) {
+      up = col[i];
+      col[i] = diag + (bitbuf_getbit(src, j) != bitbuf_getbit(pat, i - 1));
+      if (up + 1 < col[i]) col[i] = up + 1;
+      if (col[i - 1] + 1 < col[i]) col[i] = col[i - 1] + 1;
+      diag = up;
+    }
+    out[j] = col[m];
+  }
+  free(col);
+}
+
+void test_find_edit() {
+  size_t i, j, k, m, off, dist;
+  size_t col[700];
+  bitbuf src = BITBUF_INIT;
+  bitbuf pat = BITBUF_INIT;
+  bitbuf slip = BITBUF_INIT;
+  bitbuf tail = BITBUF_INIT;
+
+  for (i = 0; i < 200; ++i) {
+    fill_rnd(&src, 300 + rnd() % 400);
+    m = 2 + rnd() % (i % 2 ? 60 : 180);
+    k = 1 + rnd() % (m / 3 + 1);
+    off = rnd() % 100;
+
+    /* Plant a copy that gained or lost a bit somewhere */
+    bitbuf_init_sub(&pat, &src, rnd() % (src.len - m), m);
+    j = rnd() % m;
+    bitbuf_init_sub(&slip, &pat, 0, j);
+    if (i % 2 == 0) bitbuf_addbit(&slip, rnd() & 1);
+    bitbuf_init_sub(&tail, &pat, j + i % 2, m - j - i % 2);
+    bitbuf_addbuf(&slip, &tail);
+    bitbuf_release(&tail);
+    bitbuf_copy_bits(&src, rnd() % (src.len - slip.len), &slip, 0, slip.len);
+
+    edit_columns(&src, &pat, off, col);
+    int want = -1;
+    size_t best = 0;
+    for (j = off; j < src.len; ++j) {
+      if (want >= 0 && col[j] >= best) break;
+      if (col[j] <= k && (want < 0 || col[j] < best)) {
+        want = j + 1;
+        best = col[j];
+      }
+    }
+    dist = m;
+    assert_num(want, bitbuf_find_edit(&src, &pat, k, off, &dist), "find_edit");
+    if (want >= 0) assert_num(best, dist, "find_edit-dist");
+    bitbuf_release(&src);
+    bitbuf_release(&pat);
+    bitbuf_release(&slip);
+  }
+  success("find_edit");
+}
+
+void test_correlate() {
+  size_t i, j, k, m, d;
+  size_t lens[] = {1, 7, 64, 65, 200, 1023, 1024, 2500};
+  uint16_t out[4000];
+  bitbuf src = BITBUF_INIT;
+  bitbuf pat = BITBUF_INIT;
+
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+    m = lens[i];
+    fill_rnd(&src, 3000 + rnd() % 1000);
+    fill_rnd(&pat, m);
+    bitbuf_copy_bits(&src, 100, &pat, 0, m);
+
+    assert_num(src.len - m + 1, bitbuf_correlate(&src, &pat, out),
+               "correlate-cnt");
+    assert_num(0, out[100], "correlate-hit");
+    for (j = 0; j + m <= src.len; j += 1 + j % 13) {
+      for (k = d = 0; k < m; ++k)
+        d += bitbuf_getbit(&src, j + k) != bitbuf_getbit(&pat, k);
+      assert_num(d, out[j], "correlate");
+    }
+    bitbuf_release(&src);
+    bitbuf_release(&pat);
+  }
+  success("correlate");
+}
+
+void test_line_codes() {
+  size_t i, j, ones, bad;
+  char str[64];
+  bitbuf src = BITBUF_INIT;
+  bitbuf enc = BITBUF_INIT;
+  bitbuf dec = BITBUF_INIT;
+  bitbuf ref = BITBUF_INIT;
+
+  bitbuf_init_str(&src, "0b0111111011111");
+  bitbuf_hdlc_stuff(&enc, &src);
+  bitbuf_bin(&enc, str);
+  assert_str(str, "011111010111110", "hdlc_stuff");
+  assert_num(0, bitbuf_hdlc_unstuff(&dec, &enc), "hdlc_unstuff");
+  assert_num(0, bitbuf_cmp_lex(&src, &dec), "hdlc_unstuff");
+  assert_num(1, bitbuf_hdlc_unstuff(&dec, &src), "hdlc_unstuff-flag");
+
+  bitbuf_nrzi_encode(&enc, &src);
+  bitbuf_bin(&enc, str);
+  assert_str(str, "0000000111111", "nrzi_encode");
+  bitbuf_manchester_encode(&enc, &src, BITBUF_MANCHESTER_IEEE);
+  bitbuf_bin(&enc, str);
+  assert_str(str, "10010101010101100101010101", "manchester_encode");
+  bitbuf_manchester_encode(&enc, &src, BITBUF_MANCHESTER_THOMAS);
+  bitbuf_bin(&enc, str);
+  assert_str(str, "01101010101010011010101010", "manchester_encode");
+  bitbuf_release(&src);
+
+  for (i = 0; i < 100; ++i) {
+    /* Mostly ones so stuffing happens often */
+    bitbuf_init(&src, 0);
+    for (j = rnd() % 1000; j > 0; --j) bitbuf_addbit(&src, rnd() % 8 != 0);
+
+    bitbuf_init(&ref, 0);
+    for (j = ones = 0; j < src.len; ++j) {
+      bitbuf_addbit(&ref, bitbuf_getbit(&src, j));
+      ones = bitbuf_getbit(&src, j) ? ones + 1 : 0;
+      if (ones == 5) {
+        bitbuf_addbit(&ref, 0);
+        ones = 0;
+      }
+    }
+    bitbuf_hdlc_stuff(&enc, &src);
+    assert_num(0, bitbuf_cmp_lex(&ref, &enc), "hdlc_stuff");
+    assert_num(0, bitbuf_hdlc_unstuff(&dec, &enc), "hdlc_unstuff");
+    assert_num(0, bitbuf_cmp_lex(&src, &dec), "hdlc_unstuff");
+
+    bitbuf_nrzi_encode(&enc, &src);
+    bitbuf_nrzi_decode(&dec, &enc);
+    assert_num(0, bitbuf_cmp_lex(&src, &dec), "nrzi");
+
+    for (j = 0; j < 2; ++j) {
+      bitbuf_manchester_encode(&enc, &src, j);
+      bitbuf_manchester_decode(&dec, &enc, j);
+      assert_num(0, bitbuf_cmp_lex(&src, &dec), "manchester");
+
+      /* Forcing one half of a symbol high breaks it if it was low */
+      bad = enc.len && !bitbuf_getbit(&enc, i % enc.len);
+      if (enc.len) bitbuf_setbit(&enc, i % enc.len, 1);
+      assert_num(bad, bitbuf_manchester_decode(&dec, &enc, j), "manchester");
+    }
+    bitbuf_release(&src);
+    bitbuf_release(&ref);
+  }
+  bitbuf_release(&enc);
+  bitbuf_release(&dec);
+  success("line_codes");
+}
+
+struct atomic_job {
+  bitbuf *bb;
+  bitbuf *dst;
+  bitbuf src;
+  size_t id;
+  size_t won;
+};
+
+static void *atomic_worker(void *arg) {
+  struct atomic_job *job = (struct atomic_job *)arg;
+  size_t i, n = job->bb->len;
+  /* Every thread tries every bit; exactly one wins each */
+  for (i = 0; i < n; ++i)
+    job->won += !bitbuf_test_and_set(job->bb, (i * 7 + job->id) % n,
+                                     BITBUF_ACQ_REL);
+  bitbuf_or_atomic_range(job->dst, job->id, &job->src, BITBUF_RELAXED);
+  return NULL;
+}
+
+void test_atomic() {
+  size_t i, j, n = 10007;
+  bitbuf bb = BITBUF_INIT;
+  bitbuf dst = BITBUF_INIT;
+  pthread_t th[4];
+  struct atomic_job job[4];
+
+  bitbuf_init_concurrent(&bb, n);
+  bitbuf_init_concurrent(&dst, n + 20);
+  for (i = 0; i < 4; ++i) {
+    /* Each thread owns every 4th bit of the destination */
+    job[i] = (struct atomic_job){&bb, &dst, BITBUF_INIT, i, 0};
+    bitbuf_init_zero(&job[i].src, n - i);
+    for (j = 0; j < n - i; j += 4) bitbuf_setbit(&job[i].src, j, 1);
+  }
+  for (i = 0; i < 4; ++i)
+    pthread_create(&th[i], NULL, atomic_worker, &job[i]);
+  for (i = 0; i < 4; ++i) {
+    pthread_join(th[i], NULL);
+    bitbuf_release(&job[i].src);
+  }
+
+  assert_num(n, job[0].won + job[1].won + job[2].won + job[3].won,
+             "test_and_set");
+  assert_num(n, bitbuf_weight(&bb), "test_and_set");
+  assert_num(n, bitbuf_weight(&dst), "or_atomic_range");
+  assert_num(n, bitbuf_find_next_zero(&dst, 0), "or_atomic_range");
+
+  assert_num(1, bitbuf_test_and_clear(&bb, 5, BITBUF_RELAXED), "test_and_clr");
+  assert_num(0, bitbuf_test_and_clear(&bb, 5, BITBUF_RELAXED), "test_and_clr");
+  assert_num(0, bitbuf_getbit(&bb, 5), "test_and_clear");
+  bitbuf_setbit_atomic(&bb, 5, BITBUF_RELAXED);
+  assert_num(1, bitbuf_getbit(&bb, 5), "setbit_atomic");
+
+  bitbuf_release(&bb);
+  bitbuf_release(&dst);
+  success("atomic");
+}
+
+void test_hash() {
+  bitbuf a = BITBUF_INIT;
+  bitbuf b = BITBUF_INIT;
+  bitbuf_init_str(&a, "0xdeadbeefcafebabe0123456789 0b101");
+  bitbuf_init_str(&b, "0xdeadbeefcafebabe0123456789 0b101");
+
+  /* Garbage past the end does not matter, length does */
+  b.buf[b.len / 8] |= GARBAGE(b.len);
+  assert_num(1, bitbuf_hash(&a, 1) == bitbuf_hash(&b, 1), "hash");
+  assert_num(0, bitbuf_hash(&a, 1) == bitbuf_hash(&a, 2), "hash-seed");
+  bitbuf_setlen(&b, b.len - 1);
+  assert_num(0, bitbuf_hash(&a, 1) == bitbuf_hash(&b, 1), "hash-len");
+
+  bitbuf_set set;
+  bitbuf_map map;
+  bitbuf_set_init(&set);
+  bitbuf_map_init(&map);
+
+  /* An empty key can be the first one stored */
+  size_t i;
+  bitbuf key = BITBUF_INIT;
+  assert_num(1, bitbuf_set_add(&set, &key), "set-empty");
+  assert_num(0, bitbuf_set_add(&set, &key), "set-empty");
+  assert_num(1, bitbuf_set_has(&set, &key), "set-empty");
+  bitbuf_map_put(&map, &key, (void *)1);
+  assert_num(1, (size_t)*bitbuf_map_get(&map, &key), "map-empty");
+  bitbuf_set_release(&set);
+  bitbuf_map_release(&map);
+  bitbuf_set_init(&set);
+  bitbuf_map_init(&map);
+
+  for (i = 0; i < 3000; ++i) {
+    bitbuf_reset(&key);
+    bitbuf_addstr(&key, "1", 2, 1);
+    bitbuf_addbyte(&key, i % 1000);
+    bitbuf_addbyte(&key, i % 1000 >> 8);
+    assert_num(i < 1000, bitbuf_set_add(&set, &key), "set-add");
+    bitbuf_map_put(&map, &key, (void *)(i + 1));
+  }
+  assert_num(1000, bitbuf_set_count(&set), "set-count");
+  assert_num(1000, bitbuf_map_count(&map), "map-count");
+
+  bitbuf_reset(&key);
+  bitbuf_addstr(&key, "1", 2, 1);
+  bitbuf_addbyte(&key, 7);
+  bitbuf_addbyte(&key, 0);
+  assert_num(1, bitbuf_set_has(&set, &key), "set-has");
+  assert_num(2008, (size_t)*bitbuf_map_get(&map, &key), "map-get");
+  bitbuf_addbit(&key, 0);
+  assert_num(0, bitbuf_set_has(&set, &key), "set-has");
+  assert_num(1, bitbuf_map_get(&map, &key) == NULL, "map-get");
+
+  bitbuf_set_release(&set);
+  bitbuf_map_release(&map);
+  bitbuf_release(&key);
+  bitbuf_release(&a);
+  bitbuf_release(&b);
+  success("hash");
+}
+
 void test_plus() {
   char str[20];
 
@@ -305,6 +1100,73 @@ void test_plus() {
   bitbuf_release(&res);
 }
 
+void test_expr() {
+  size_t i, j, lens[] = {1, 7, 64, 4096, 4096 * 3 + 5, BITBUF_PAR_MIN * 8 + 3};
+  bitbuf in[4], ones = BITBUF_INIT, t = BITBUF_INIT, ref = BITBUF_INIT;
+  bitbuf res = BITBUF_INIT;
+  bitbuf_expr e;
+
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+    size_t n = lens[i];
+    for (j = 0; j < 4; ++j) fill_rnd(&in[j], n);
+    bitbuf_init_zero(&ones, n);
+    bitbuf_set_range(&ones, 0, n);
+    bitbuf_set_threads(i % 2 ? 3 : 1);
+
+    /* (a & b) | (c & ~d) ^ ~a */
+    bitbuf_expr_init(&e);
+    int a = bitbuf_expr_leaf(&e, &in[0]);
+    int b = bitbuf_expr_leaf(&e, &in[1]);
+    int cd = bitbuf_expr_andnot(&e, bitbuf_expr_leaf(&e, &in[2]),
+                                bitbuf_expr_leaf(&e, &in[3]));
+    int na = bitbuf_expr_not(&e, a);
+    int root = bitbuf_expr_or(&e, bitbuf_expr_and(&e, a, b),
+                              bitbuf_expr_xor(&e, cd, na));
+    assert_num(a, bitbuf_expr_leaf(&e, &in[0]), "expr-same-leaf");
+
+    bitbuf_init(&t, 0);
+    bitbuf_init(&ref, 0);
+    bitbuf_xor(&in[3], &ones, &t);
+    bitbuf_and(&in[2], &t, &ref);
+    bitbuf_xor(&in[0], &ones, &t);
+    bitbuf_xor(&ref, &t, &ref);
+    bitbuf_and(&in[0], &in[1], &t);
+    bitbuf_or(&ref, &t, &ref);
+
+    bitbuf_init(&res, 0);
+    bitbuf_expr_eval(&e, root, &res);
+    assert_num(n, res.len, "expr-len");
+    assert_num(0, bitbuf_cmp(&ref, &res), "expr-eval");
+    assert_num(bitbuf_weight(&ref), bitbuf_expr_weight(&e, root),
+               "expr-weight");
+
+    /* Unused nodes are skipped and a leaf may be its own result */
+    assert_num(n - bitbuf_weight(&in[0]), bitbuf_expr_weight(&e, na),
+               "expr-not");
+    bitbuf_and(&in[0], &in[1], &ref);
+    bitbuf_expr_eval(&e, bitbuf_expr_and(&e, a, b), &in[0]);
+    assert_num(0, bitbuf_cmp(&ref, &in[0]), "expr-in-place");
+
+    for (j = 0; j < 4; ++j) bitbuf_release(&in[j]);
+    bitbuf_release(&ones);
+    bitbuf_release(&t);
+    bitbuf_release(&ref);
+    bitbuf_release(&res);
+  }
+  bitbuf_set_threads(1);
+
+  /* An expression over empty buffers is empty */
+  bitbuf_init(&in[0], 0);
+  bitbuf_expr_init(&e);
+  bitbuf_init(&res, 0);
+  bitbuf_expr_eval(&e, bitbuf_expr_not(&e, bitbuf_expr_leaf(&e, &in[0])),
+                   &res);
+  assert_num(0, res.len, "expr-empty");
+  bitbuf_release(&in[0]);
+  bitbuf_release(&res);
+  success("expr");
+}
+
 void test_shift() {
   char str[20];
 
@@ -368,6 +1230,27 @@ void test_find() {
   assert_num(933, cnt, "find");
   bitbuf_release(&bb);
   bitbuf_release(&pat);
+
+  /* Short patterns, with and without garbling, against a direct scan */
+  size_t i, j, k, m, g, off, d;
+  for (i = 0; i < 400; ++i) {
+    fill_rnd(&bb, 100 + rnd() % 200);
+    m = 1 + rnd() % (i % 2 ? 8 : 64);
+    g = rnd() % (m < 4 ? m : 4);
+    off = rnd() % (bb.len + 2);
+    fill_rnd(&pat, m);
+
+    int want = -1;
+    for (j = off; want < 0 && j + m <= bb.len; ++j) {
+      for (k = d = 0; k < m; ++k)
+        d += bitbuf_getbit(&bb, j + k) != bitbuf_getbit(&pat, k);
+      if (d <= g) want = j;
+    }
+    assert_num(want, bitbuf_find(&bb, &pat, g, off), "find-short");
+    bitbuf_release(&bb);
+    bitbuf_release(&pat);
+  }
+  success("find");
 }
 
 void test_replace() {
@@ -434,6 +1317,48 @@ void test_reverse() {
   bitbuf_release(&bb);
 }
 
+void test_flip_order() {
+  size_t i, n;
+  char str[16];
+  bitbuf bb = BITBUF_INIT;
+  bitbuf ref = BITBUF_INIT;
+
+  /* `ref` laid out byte by byte in the other order comes back as `ref` */
+  for (n = 0; n < 1200; n += 37) {
+    fill_rnd(&ref, n);
+    bitbuf_init_zero(&bb, n);
+    for (i = 0; i < BYTE_LEN(n); ++i) bb.buf[i] = REV8(ref.buf[i]);
+    bitbuf_flip_order(&bb);
+    assert_num(n, bb.len, "flip_order");
+    assert_num(0, bitbuf_cmp(&ref, &bb), "flip_order");
+    if (n % 8) assert_num(0, bb.buf[n / 8] & GARBAGE(n), "flip_order-tail");
+    bitbuf_release(&bb);
+    bitbuf_release(&ref);
+  }
+
+  /* 11 bits written in the other order keep their last three */
+  bitbuf_init_zero(&bb, 11);
+  bb.buf[0] = REV8(RAW(0xb0));
+  bb.buf[1] = REV8(RAW(0xc0));
+  bitbuf_flip_order(&bb);
+  bitbuf_bin(&bb, str);
+  assert_str(str, "10110000110", "flip_order-partial");
+  bitbuf_release(&bb);
+
+  /* A byte starts at its most or least significant bit */
+  bitbuf_init(&bb, 0);
+  bitbuf_addbyte(&bb, 0x01);
+#ifdef BITBUF_LSB_FIRST
+  assert_num(1, bitbuf_getbit(&bb, 0), "flip_order-native");
+#else
+  assert_num(1, bitbuf_getbit(&bb, 7), "flip_order-native");
+#endif
+  bitbuf_flip_order(&bb);
+  assert_num(0x80, bb.buf[0], "flip_order-native");
+  bitbuf_release(&bb);
+  success("flip_order");
+}
+
 void test_detach() {
   bitbuf bb = BITBUF_INIT;
   bitbuf_init_str(&bb, "0xdeadbeef");
@@ -442,7 +1367,7 @@ void test_detach() {
   buf_len = bb.len;
 
   unsigned char *buf = bitbuf_detach(&bb, &array_len);
-  assert_num(0xde, buf[0], "detach");
+  assert_num(RAW(0xde), buf[0], "detach");
   assert_num(buf_len, array_len, "detach");
   success("detach");
 
@@ -469,6 +1394,128 @@ void test_io() {
   success("read");
 }
 
+static void count_match(size_t pos, void *ctx) {
+  size_t *hits = (size_t *)ctx;
+  hits[hits[0]++ + 1] = pos;
+}
+
+void test_find_stream() {
+  /* Spread matches over several blocks, one of them straddling a boundary */
+  const size_t offs[] = {3, MAX_BUF * 8 - 5, MAX_BUF * 8 * 3 + 1};
+  size_t i, hits[8] = {0};
+
+  bitbuf bb = BITBUF_INIT;
+  bitbuf_init_zero(&bb, MAX_BUF * 8 * 4);
+  bitbuf pat = BITBUF_INIT;
+  bitbuf_init_str(&pat, "0xcafe");
+  for (i = 0; i < 3; ++i) {
+    bitbuf_setbyte(&bb, offs[i] / 8, offs[i] % 8, RAW(0xca));
+    bitbuf_setbyte(&bb, offs[i] / 8 + 1, offs[i] % 8, RAW(0xfe));
+  }
+
+  int fds[2];
+  FILE *fp = tmpfile();
+  bitbuf_write(&bb, fp);
+  rewind(fp);
+
+  assert_num(3, bitbuf_find_stream(fp, &pat, 0, count_match, hits),
+             "find_stream");
+  for (i = 0; i < 3; ++i) assert_num(offs[i], hits[i + 1], "find_stream");
+  fclose(fp);
+
+  /* Pipes can't be seeked */
+  hits[0] = 0;
+  if (pipe(fds) != 0) exit(EXIT_FAILURE);
+  if (fork() == 0) {
+    close(fds[0]);
+    if (write(fds[1], bb.buf, BYTE_LEN(bb.len)) < 0) exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+  close(fds[1]);
+  assert_num(3, bitbuf_find_fd(fds[0], &pat, 0, count_match, hits),
+             "find_fd");
+  assert_num(offs[2], hits[3], "find_fd");
+  close(fds[0]);
+  wait(NULL);
+
+  bitbuf_release(&bb);
+  bitbuf_release(&pat);
+  success("find_stream");
+}
+
+void test_ingest() {
+  const size_t blk = 1000;
+  size_t i, pos, total = 0;
+
+  bitbuf bb = BITBUF_INIT;
+  bitbuf_init_zero(&bb, blk * 8 * 5 + 24);
+  for (i = 0; i < BYTE_LEN(bb.len); ++i) bb.buf[i] = i * 7;
+
+  FILE *fp = tmpfile();
+  bitbuf_write(&bb, fp);
+  rewind(fp);
+
+  bitbuf view = BITBUF_INIT;
+  bitbuf_ingest *ing = bitbuf_ingest_open(fileno(fp), blk, 3);
+  while (bitbuf_ingest_next(ing, &view, &pos)) {
+    assert_num(total, pos, "ingest");
+    assert_num(0, memcmp(view.buf, bb.buf + pos / 8, BYTE_LEN(view.len)),
+               "ingest");
+    total += view.len;
+    bitbuf_ingest_done(ing, &view);
+  }
+  assert_num(bb.len, total, "ingest");
+  assert_num(0, bitbuf_ingest_next(ing, &view, &pos), "ingest");
+  bitbuf_ingest_close(ing);
+  fclose(fp);
+
+  /* Closing while the reader is blocked on an idle pipe */
+  int fds[2];
+  if (pipe(fds) != 0) exit(EXIT_FAILURE);
+  ing = bitbuf_ingest_open(fds[0], blk, 2);
+  bitbuf_ingest_close(ing);
+  close(fds[0]);
+  close(fds[1]);
+
+  bitbuf_release(&bb);
+  success("ingest");
+}
+
+void test_archive() {
+  const char fname[] = "TEST_BITBUF_ARCHIVE";
+  const char *strs[] = {"0xdeadbeef 0b110", "0b", "0xcafe 0b1", "0x12"};
+  bitbuf bbs[4];
+  size_t i;
+
+  for (i = 0; i < 4; ++i) {
+    bitbuf_init(&bbs[i], 0);
+    bitbuf_init_str(&bbs[i], strs[i]);
+  }
+  /* Dirty the bits past the end, they must not be persisted */
+  bbs[2].buf[2] |= GARBAGE(1);
+
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  size_t written = bitbuf_archive_write(fd, bbs, 4);
+  close(fd);
+  assert_num(32 + 8 * 3 + 4 * 16, written, "archive");
+
+  bitbuf view = BITBUF_INIT;
+  bitbuf_archive *ar = bitbuf_archive_open(fname);
+  assert_num(4, bitbuf_archive_count(ar), "archive");
+  for (i = 0; i < 4; ++i) {
+    bitbuf_archive_get(ar, i, &view);
+    assert_num(bbs[i].len, view.len, "archive-len");
+    assert_num(0, memcmp(view.buf, bbs[i].buf, bbs[i].len / 8), "archive");
+  }
+  bitbuf_archive_get(ar, 2, &view);
+  assert_num(0xff & ~GARBAGE(1), view.buf[2], "archive-tail");
+
+  bitbuf_archive_close(ar);
+  remove(fname);
+  for (i = 0; i < 4; ++i) bitbuf_release(&bbs[i]);
+  success("archive");
+}
+
 void test_rep() {
   bitbuf bb = BITBUF_INIT;
   bitbuf_init_str(&bb, "0x0123456789 0b01");
@@ -514,6 +1561,44 @@ void test_num() {
   bitbuf_release(&b2);
 }
 
+void test_stats() {
+  bitbuf_stats st;
+  bitbuf_stats_reset();
+
+  bitbuf bb = BITBUF_INIT;
+  bitbuf pat = BITBUF_INIT;
+  bitbuf_init_str(&bb, "0xdeadbeef");
+  bitbuf_lsh(&bb, 3);
+  bitbuf_lsh(&bb, 5);
+  bitbuf_stats_snapshot(&st);
+  bitbuf_release(&bb);
+
+#ifdef BITBUF_STATS
+  assert_num(2, st.fn[BITBUF_STAT_LSH].calls, "stats");
+  assert_num(8, st.fn[BITBUF_STAT_LSH].bytes, "stats");
+  assert_num(1, st.reallocs > 0, "stats-realloc");
+  assert_num(1, st.peak_bits >= 32, "stats-peak");
+#else
+  assert_num(0, st.fn[BITBUF_STAT_LSH].calls, "stats");
+  assert_num(0, st.peak_bits, "stats-peak");
+#endif
+
+  /* Long patterns are searched through a stack window */
+  size_t before;
+  bitbuf_init_str(&bb, "0x0123456789abcdef0123456789abcdef");
+  bitbuf_init_str(&pat, "0x89abcdef0123456789ab");
+  bitbuf_stats_snapshot(&st);
+  before = st.alloc_bits;
+  assert_num(32, bitbuf_find(&bb, &pat, 0, 0), "stats-find");
+  bitbuf_stats_snapshot(&st);
+  assert_num(1, st.alloc_bits == before, "stats-find");
+  bitbuf_release(&bb);
+  bitbuf_release(&pat);
+
+  assert_str((char *)bitbuf_stats_name(BITBUF_STAT_GROW), "grow", "stats");
+  success("stats");
+}
+
 int main() {
   test_hexstr();
   test_binstr();
@@ -525,22 +1610,45 @@ int main() {
   test_prepend();
   test_initstr();
   test_getbit();
+  test_copy_bits();
   test_setbit();
   test_setgetbyte();
   test_slice();
   test_op();
   test_plus();
+  test_mask();
+  test_interleave();
+  test_pack();
+  test_transpose();
+  test_crc();
+  test_hash();
+  test_cmp();
+  test_parallel();
+  test_ranges();
+  test_scan();
+  test_find_compiled();
+  test_batch();
+  test_find_edit();
+  test_correlate();
+  test_line_codes();
+  test_atomic();
+  test_expr();
   test_shift();
   test_weight();
   test_find();
   test_replace();
   test_append();
   test_reverse();
+  test_flip_order();
   test_detach();
   test_io();
+  test_find_stream();
+  test_ingest();
+  test_archive();
   test_rep();
   test_align();
   test_num();
+  test_stats();
 
   printf("--------------------------\n");
   printf("%i tests passed\n", TEST_CNT);
@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+#include "bitbuf.hpp"
+
+int TEST_CNT = 0;
+
+static void check(bool ok, const char *fname) {
+  if (!ok) {
+    std::fprintf(stderr, "%s FAILED\n", fname);
+    std::exit(EXIT_FAILURE);
+  }
+  ++TEST_CNT;
+}
+
+static void success(const char *fname) { std::printf("%-20sOK\n", fname); }
+
+static_assert(!std::is_copy_constructible<bb::buffer>::value,
+              "buffer must not copy");
+static_assert(std::is_nothrow_move_constructible<bb::buffer>::value,
+              "buffer must move without throwing");
+
+/* Everything about fixed<N> folds at compile time */
+constexpr bb::fixed<100> pattern() {
+  bb::fixed<100> f;
+  for (std::size_t i = 0; i < 100; i += 3) f.set(i);
+  return f;
+}
+static_assert(pattern().count() == 34, "fixed count");
+static_assert(pattern()[99] && !pattern()[98], "fixed get");
+static_assert((~pattern()).count() == 66, "fixed not");
+static_assert((pattern() & ~pattern()).count() == 0, "fixed and");
+static_assert((pattern() | ~pattern()).count() == 100, "fixed or");
+static_assert((pattern() ^ pattern()) == bb::fixed<100>(), "fixed xor");
+
+bb::buffer make(const char *str) { return bb::buffer::parse(str); }
+
+void test_buffer() {
+  bb::buffer a = make("0xdeadbeef");
+  bb::buffer b = make("0x0000ffff");
+  unsigned char *p = a.get()->buf;
+
+  bb::buffer c = std::move(a);
+  check(c.get()->buf == p && a.empty(), "buffer-move");
+  check((c & b).hex() == "0000beef", "buffer-and");
+  check((c | b).hex() == "deadffff", "buffer-or");
+  check((c ^ b).count() == c.count() + b.count() - 2 * (c & b).count(),
+        "buffer-xor");
+
+  bb::buffer d = c.clone();
+  check(d == c && d.get()->buf != c.get()->buf, "buffer-clone");
+  d.push_back(false);
+  check(c < d && c != d, "buffer-order");
+  d.append(b);
+  check(d.size() == 65 && d.sub(33, 32).to_buffer() == b, "buffer-append");
+  success("buffer");
+}
+
+void test_view() {
+  bb::buffer a = make("0b0011010111");
+  bb::view v = a.sub(2, 6);
+  check(v.size() == 6 && v[0] && v[1] && !v[2], "view-get");
+  check(v.sub(3, 3) == a.sub(3, 3) && v != a.sub(3, 6), "view-eq");
+  check(v.first_diff(a.all()) == 0, "view-diff");
+  check(v.to_buffer().bin() == "110101", "view-copy");
+  success("view");
+}
+
+void test_fixed() {
+  bb::buffer a = make("0xdeadbeefcafebabe0123456789");
+  bb::fixed<104> f = bb::fixed<104>::from(a.get());
+  check(f.count() == a.count(), "fixed-from");
+  check(f.to_buffer() == a, "fixed-to");
+  f.set(0, false);
+  check(f.to_buffer() != a && !f[0], "fixed-set");
+  success("fixed");
+}
+
+int main() {
+  test_buffer();
+  test_view();
+  test_fixed();
+
+  std::printf("--------------------------\n");
+  std::printf("%i tests passed\n", TEST_CNT);
+  return EXIT_SUCCESS;
+}